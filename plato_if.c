@@ -21,22 +21,43 @@
  * Cyber1 system on the internet.
  */
 
+#define _GNU_SOURCE
+
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <netdb.h>
 #include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
 #include <sys/socket.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
+#include <sys/un.h>
+#include <linux/gpio.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <alsa/asoundlib.h>
 #include <linux/spi/spidev.h>
 
+#include "plato_text.h"
+
 #define NO_TERMINAL	0
 #define POLL		1
 #define HOST_DECODE1	0
@@ -51,15 +72,14 @@
 bool	audio_opened;
 
 #define SND_RATE	48000	/* Sound sample rate */
-#define SND_PERIODS	2
-#define SND_CHANNELS	2
-#define FRAME_SIZE	(sizeof(int16_t) * SND_CHANNELS)
-#define FRAMES_PER_PERIOD	(SND_RATE / 60)
-#define PERIOD_SIZE	(FRAMES_PER_PERIOD * FRAME_SIZE)
-#define SND_BUFFER_SIZE	(FRAMES_PER_PERIOD * SND_PERIODS)
+#define SND_PERIODS	2	/* Default number of periods */
+#define SND_CHANNELS	2	/* Channels used if the card has no mono */
+#define FRAMES_PER_WORD	(SND_RATE / 60)	/* Audio frames per terminal word */
+#define FRAMES_PER_PERIOD	FRAMES_PER_WORD	/* Default period size */
+#define SND_MAX_PERIOD	8192	/* Largest period size in frames */
+#define NSEC_PER_SEC	1000000000ULL
 #define NVSHIFT		2
 #define VOICES		(1 << NVSHIFT)
-#define PHASEINCR	((GSW_CRYSTAL + SND_RATE - 1) / SND_RATE)
 
 /* GSW frequency calculation
  * ext(x) = (crystal/x-2)/4
@@ -71,6 +91,39 @@ bool	audio_opened;
 #define F2E(f)	((GSW_CRYSTAL / (f) - 2) / 4)
 #define E2D(e)	((e) * 4 + 2)
 
+/* Voices are direct digital synthesizers: a 32-bit phase that wraps
+ * once per cycle of the wave, advanced by a fixed increment each
+ * sample. For divisor d the increment is
+ *
+ *	2^32 * freq / SND_RATE = 2^32 * GSW_CRYSTAL / (d * SND_RATE)
+ *
+ * rounded to nearest. Divisors whose frequency is above SND_RATE
+ * would need an increment of 2^32 or more and are silent (0).
+ */
+#define DDS_RATE(d)	((uint64_t)(d) * SND_RATE)
+#define DDS_INCR(d)	(DDS_RATE(d) < GSW_CRYSTAL ? 0 : \
+	(uint32_t)((((uint64_t)GSW_CRYSTAL << 32) + DDS_RATE(d) / 2) / \
+		   DDS_RATE(d)))
+#define DDS_1(e)	DDS_INCR(E2D(e))
+#define DDS_2(e)	DDS_1(e), DDS_1((e) + 1)
+#define DDS_4(e)	DDS_2(e), DDS_2((e) + 2)
+#define DDS_8(e)	DDS_4(e), DDS_4((e) + 4)
+#define DDS_16(e)	DDS_8(e), DDS_8((e) + 8)
+#define DDS_32(e)	DDS_16(e), DDS_16((e) + 16)
+#define DDS_64(e)	DDS_32(e), DDS_32((e) + 32)
+#define DDS_128(e)	DDS_64(e), DDS_64((e) + 64)
+#define DDS_256(e)	DDS_128(e), DDS_128((e) + 128)
+#define DDS_512(e)	DDS_256(e), DDS_256((e) + 256)
+#define DDS_1K(e)	DDS_512(e), DDS_512((e) + 512)
+#define DDS_2K(e)	DDS_1K(e), DDS_1K((e) + 1024)
+#define DDS_4K(e)	DDS_2K(e), DDS_2K((e) + 2048)
+#define DDS_8K(e)	DDS_4K(e), DDS_4K((e) + 4096)
+#define DDS_16K(e)	DDS_8K(e), DDS_8K((e) + 8192)
+#define DDS_32K(e)	DDS_16K(e), DDS_16K((e) + 16384)
+
+/* Phase increment for every 15-bit GSW ext value */
+static const uint32_t dds_incr[1 << 15] = { DDS_32K(0) };
+
 struct wave {
 	const int16_t	*samples;
 	uint8_t		nsamp;
@@ -81,18 +134,6 @@ struct wave {
 
 WAVEDEF(sq, 0x7FFF, 0);
 
-static const int16_t silence[FRAMES_PER_PERIOD * SND_CHANNELS];
-
-struct voice {
-	uint32_t	div;
-	uint32_t	frac;
-	uint16_t	shift;
-	uint16_t	step;
-	uint16_t	phase;
-	const struct amp	*amp;
-	struct wave	wave;
-};
-
 struct amp {
 	const uint16_t	mult;
 	const uint8_t	shift;
@@ -103,55 +144,425 @@ static const struct amp amp[8] = {
 	{ 27, 6},	{ 9, 4 },	{ 3, 2 },	{ 1, 0 }
 };
 
-/* frac_gen - Generate fraction number to avoid division
- * @div: Desired divisor
- * @shift: Pointer to uint16_t to receive shift count
+#define WAVE_MAX_SAMPLES	256	/* nsamp is a uint8_t */
+
+/* struct gsw_voices - GSW voice generators as structure of arrays
+ * @incr: Phase increment per sample from dds_incr, 0 if silent
+ * @phase: Phase, one wave cycle per 2^32
+ * @amp: Amplitude
+ * @wave: Waveform
+ * @level: Wave samples scaled by @amp, indexed by wave sample
+ */
+struct gsw_voices {
+	uint32_t	incr[VOICES];
+	uint32_t	phase[VOICES];
+	const struct amp *amp[VOICES];
+	struct wave	wave[VOICES];
+	int32_t		level[VOICES][WAVE_MAX_SAMPLES];
+};
+
+/* WAVE_IX - Wave sample index for a phase
+ * @phase: 32-bit voice phase
+ * @nsamp: Samples in the wave
+ */
+#define WAVE_IX(phase, nsamp)	((((phase) >> 16) * (nsamp)) >> 16)
+
+/* voice_level - Recompute scaled wave samples for a voice
+ * @vs: Pointer to gsw_voices
+ * @v: Voice index
+ */
+static void voice_level(struct gsw_voices *vs, int v)
+{
+	const struct amp *a = vs->amp[v];
+	const struct wave *w = &vs->wave[v];
+	int i;
+
+	for (i = 0; i < w->nsamp; ++i)
+		vs->level[v][i] = a ? (a->mult * w->samples[i]) >> a->shift : 0;
+}
+
+/* voice_block_scalar - Add samples of one voice into a block
+ * @vs: Pointer to gsw_voices
+ * @v: Voice index
+ * @acc: Accumulated samples
+ * @n: Number of samples in @acc
+ */
+static void voice_block_scalar(struct gsw_voices *vs, int v, uint32_t *acc,
+			       int n)
+{
+	const int32_t *level = vs->level[v];
+	uint32_t nsamp = vs->wave[v].nsamp;
+	uint32_t incr = vs->incr[v];
+	uint32_t phase = vs->phase[v];
+	int i;
+
+	for (i = 0; i < n; ++i) {
+		phase += incr;
+		acc[i] += level[WAVE_IX(phase, nsamp)];
+	}
+	vs->phase[v] = phase;
+}
+
+/*
+ * The vector kernels below run LANES consecutive samples of one voice
+ * side by side. Lane j holds the phase of sample LANES * m + j, so each
+ * lane advances by LANES times the voice increment per step.
+ */
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#if defined(__AVX2__)
+#define VEC_LANES	8
+
+/* voice_block_vec - Add samples of one voice into a block using AVX2
+ * @vs: Pointer to gsw_voices
+ * @v: Voice index
+ * @acc: Accumulated samples
+ * @n: Number of samples in @acc
  *
- * Returns fractional value
+ * Returns false if the voice needs the scalar kernel
  */
-static uint32_t frac_gen(uint32_t div, uint16_t *shift)
+static bool voice_block_vec(struct gsw_voices *vs, int v, uint32_t *acc,
+			    int n)
 {
-	uint32_t l32;
-	uint32_t bit;
+	uint32_t incr = vs->incr[v];
+	uint32_t phase = vs->phase[v];
+	__m256i vinc, vnsamp, vp;
+	int i;
 
-	l32 = 1 << 30;
-	l32 /= div;
-	for (bit = 29; ((1 << bit) & l32) == 0; --bit)
-		;
-	if (bit > 15) {
-		l32 += 1 << (bit - 16);
-		l32 >>= bit - 15;
-		*shift = 16 + 29 - bit;
-	} else
-		*shift = 30;
-	return l32;
+	if (n % VEC_LANES)
+		return false;
+
+	vp = _mm256_add_epi32(_mm256_set1_epi32(phase),
+			      _mm256_mullo_epi32(_mm256_set1_epi32(incr),
+						 _mm256_setr_epi32(1, 2, 3, 4,
+								   5, 6, 7, 8)));
+	vinc = _mm256_set1_epi32(VEC_LANES * incr);
+	vnsamp = _mm256_set1_epi32(vs->wave[v].nsamp);
+
+	for (i = 0; i < n; i += VEC_LANES) {
+		__m256i ix, out, a;
+
+		ix = _mm256_srli_epi32(_mm256_mullo_epi32(_mm256_srli_epi32(vp, 16),
+							  vnsamp), 16);
+		out = _mm256_i32gather_epi32((const int *)vs->level[v], ix, 4);
+		a = _mm256_loadu_si256((const __m256i *)&acc[i]);
+		_mm256_storeu_si256((__m256i *)&acc[i],
+				    _mm256_add_epi32(a, out));
+		vp = _mm256_add_epi32(vp, vinc);
+	}
+
+	vs->phase[v] = phase + n * incr;
+	return true;
+}
+
+#elif defined(__SSE2__)
+#define VEC_LANES	4
+#define VEC_MAX_NSAMP	4	/* Waves selected without a gather */
+
+/* mullo32 - Low 32 bits of 32-bit lane products, which SSE2 lacks */
+static inline __m128i mullo32(__m128i a, __m128i b)
+{
+	__m128i even = _mm_mul_epu32(a, b);
+	__m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32),
+				    _mm_srli_epi64(b, 32));
+
+	return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+				  _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
 }
 
-/* generate - Generate next sample for a voice
- * @v: Pointer to voice structure
+/* voice_block_vec - Add samples of one voice into a block using SSE2
+ * @vs: Pointer to gsw_voices
+ * @v: Voice index
+ * @acc: Accumulated samples
+ * @n: Number of samples in @acc
+ *
+ * Returns false if the voice needs the scalar kernel
  */
-static unsigned int generate(struct voice *v)
+static bool voice_block_vec(struct gsw_voices *vs, int v, uint32_t *acc,
+			    int n)
 {
-	uint32_t product;
-	uint16_t ix;
+	uint32_t incr = vs->incr[v];
+	uint32_t phase = vs->phase[v];
+	int nsamp = vs->wave[v].nsamp;
+	__m128i vinc, vnsamp, vp;
+	__m128i vix[VEC_MAX_NSAMP];
+	__m128i vlevel[VEC_MAX_NSAMP];
+	int i;
+	int k;
 
-	if (v->div < PHASEINCR)
-		return 0;
+	if (n % VEC_LANES || nsamp > VEC_MAX_NSAMP)
+		return false;
+
+	for (k = 0; k < nsamp; ++k) {
+		vix[k] = _mm_set1_epi32(k);
+		vlevel[k] = _mm_set1_epi32(vs->level[v][k]);
+	}
+	vp = _mm_setr_epi32(phase + incr, phase + 2 * incr,
+			    phase + 3 * incr, phase + 4 * incr);
+	vinc = _mm_set1_epi32(VEC_LANES * incr);
+	vnsamp = _mm_set1_epi32(nsamp);
+
+	for (i = 0; i < n; i += VEC_LANES) {
+		__m128i ix, out, a;
+
+		ix = _mm_srli_epi32(mullo32(_mm_srli_epi32(vp, 16), vnsamp), 16);
+		out = _mm_setzero_si128();
+		for (k = 0; k < nsamp; ++k)
+			out = _mm_or_si128(out,
+					   _mm_and_si128(_mm_cmpeq_epi32(ix, vix[k]),
+							 vlevel[k]));
+		a = _mm_loadu_si128((const __m128i *)&acc[i]);
+		_mm_storeu_si128((__m128i *)&acc[i], _mm_add_epi32(a, out));
+		vp = _mm_add_epi32(vp, vinc);
+	}
+
+	vs->phase[v] = phase + n * incr;
+	return true;
+}
+
+#else /* No vector unit */
+
+static bool voice_block_vec(struct gsw_voices *vs UNUSED, int v UNUSED,
+			    uint32_t *acc UNUSED, int n UNUSED)
+{
+	return false;
+}
+#endif /* __AVX2__ / __SSE2__ */
+
+/* synth_block - Render a block of samples for all voices
+ * @vs: Pointer to gsw_voices
+ * @out: Interleaved output samples
+ * @channels: Samples per frame in @out, all given the same value
+ * @acc: Scratch accumulator, @n entries
+ * @n: Number of frames to render
+ *
+ * Silent voices are skipped, the rest are summed and scaled down by
+ * NVSHIFT.
+ */
+static void synth_block(struct gsw_voices *vs, int16_t *out, int channels,
+			uint32_t *acc, int n)
+{
+	int v;
+	int i;
+
+	memset(acc, 0, n * sizeof(*acc));
+	for (v = 0; v < VOICES; ++v) {
+		if (!vs->incr[v])
+			continue;
+		if (!voice_block_vec(vs, v, acc, n))
+			voice_block_scalar(vs, v, acc, n);
+	}
 
-	v->phase += PHASEINCR;
-	while (v->phase >= v->div)
-		v->phase -= v->div;
+	if (channels == 1) {
+		for (i = 0; i < n; ++i)
+			out[i] = acc[i] >> NVSHIFT;
+		return;
+	}
+	for (i = 0; i < n; ++i) {
+		int16_t sample = acc[i] >> NVSHIFT;
+		int c;
+
+		for (c = 0; c < channels; ++c)
+			*out++ = sample;
+	}
+}
+
+/* struct word_ring - Single-producer, single-consumer ring of words
+ * @head: Free-running index of next slot to fill, written by producer
+ * @tail_cache: Producer's last view of @tail
+ * @tail: Free-running index of next slot to drain, written by consumer
+ * @head_cache: Consumer's last view of @head
+ * @mask: Ring size - 1, size must be a power of two
+ * @words: Ring storage
+ *
+ * The occupancy is always @head - @tail. Each side only reloads the
+ * other side's index when its cached copy says the ring is full or
+ * empty, so the shared cache lines are touched rarely.
+ */
+struct word_ring {
+	_Atomic uint32_t head __attribute__((__aligned__(64)));
+	uint32_t	tail_cache;
+	_Atomic uint32_t tail __attribute__((__aligned__(64)));
+	uint32_t	head_cache;
+	uint32_t	mask __attribute__((__aligned__(64)));
+	uint32_t	*words;
+};
+
+/* ring_init() - Initialize a word ring
+ * @r: Pointer to word_ring
+ * @words: Storage for the ring
+ * @size: Number of entries in @words, a power of two
+ */
+static void ring_init(struct word_ring *r, uint32_t *words, uint32_t size)
+{
+	atomic_init(&r->head, 0);
+	atomic_init(&r->tail, 0);
+	r->tail_cache = 0;
+	r->head_cache = 0;
+	r->mask = size - 1;
+	r->words = words;
+}
+
+/* ring_count() - Return number of words in ring
+ * @r: Pointer to word_ring
+ */
+static uint32_t ring_count(struct word_ring *r)
+{
+	return atomic_load_explicit(&r->head, memory_order_acquire) -
+	       atomic_load_explicit(&r->tail, memory_order_acquire);
+}
+
+/* ring_space() - Producer side, return free slots in ring
+ * @r: Pointer to word_ring
+ * @want: Number of slots wanted
+ *
+ * Returns free slots, refreshing the cached tail only if needed
+ */
+static uint32_t ring_space(struct word_ring *r, uint32_t head, uint32_t want)
+{
+	uint32_t space = r->mask + 1 - (head - r->tail_cache);
+
+	if (space < want) {
+		r->tail_cache = atomic_load_explicit(&r->tail,
+						     memory_order_acquire);
+		space = r->mask + 1 - (head - r->tail_cache);
+	}
+	return space;
+}
+
+/* ring_avail() - Consumer side, return words available in ring
+ * @r: Pointer to word_ring
+ * @want: Number of words wanted
+ *
+ * Returns words available, refreshing the cached head only if needed
+ */
+static uint32_t ring_avail(struct word_ring *r, uint32_t tail, uint32_t want)
+{
+	uint32_t avail = r->head_cache - tail;
+
+	if (avail < want) {
+		r->head_cache = atomic_load_explicit(&r->head,
+						     memory_order_acquire);
+		avail = r->head_cache - tail;
+	}
+	return avail;
+}
+
+/* ring_put() - Add a word to ring
+ * @r: Pointer to word_ring
+ * @w: Word to add
+ *
+ * Returns true if added, false if the ring was full
+ */
+static bool ring_put(struct word_ring *r, uint32_t w)
+{
+	uint32_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+
+	if (!ring_space(r, head, 1))
+		return false;
+	r->words[head & r->mask] = w;
+	atomic_store_explicit(&r->head, head + 1, memory_order_release);
+	return true;
+}
+
+/* ring_put_batch() - Add several words to ring
+ * @r: Pointer to word_ring
+ * @w: Words to add
+ * @n: Number of words at @w
+ *
+ * Returns number of words added, which is less than @n if ring filled
+ */
+static uint32_t ring_put_batch(struct word_ring *r, const uint32_t *w,
+			       uint32_t n)
+{
+	uint32_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+	uint32_t space = ring_space(r, head, n);
+	uint32_t i;
+
+	if (n > space)
+		n = space;
+	for (i = 0; i < n; ++i)
+		r->words[(head + i) & r->mask] = w[i];
+	atomic_store_explicit(&r->head, head + n, memory_order_release);
+	return n;
+}
+
+/* ring_get() - Remove a word from ring
+ * @r: Pointer to word_ring
+ * @w: Pointer to receive word
+ *
+ * Returns true if a word was removed, false if the ring was empty
+ */
+static bool ring_get(struct word_ring *r, uint32_t *w)
+{
+	uint32_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+
+	if (!ring_avail(r, tail, 1))
+		return false;
+	*w = r->words[tail & r->mask];
+	atomic_store_explicit(&r->tail, tail + 1, memory_order_release);
+	return true;
+}
+
+/* ring_peek() - Consumer side, look at a word without removing it
+ * @r: Pointer to word_ring
+ * @n: Offset from the next word to be removed
+ * @w: Pointer to receive word
+ *
+ * Returns true if there are more than @n words in the ring
+ */
+static bool ring_peek(struct word_ring *r, uint32_t n, uint32_t *w)
+{
+	uint32_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+
+	if (ring_avail(r, tail, n + 1) <= n)
+		return false;
+	*w = r->words[(tail + n) & r->mask];
+	return true;
+}
+
+/* ring_get_batch() - Remove several words from ring
+ * @r: Pointer to word_ring
+ * @w: Buffer to receive words
+ * @n: Size of @w in words
+ *
+ * Returns number of words removed
+ */
+static uint32_t ring_get_batch(struct word_ring *r, uint32_t *w, uint32_t n)
+{
+	uint32_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	uint32_t avail = ring_avail(r, tail, n);
+	uint32_t i;
+
+	if (n > avail)
+		n = avail;
+	for (i = 0; i < n; ++i)
+		w[i] = r->words[(tail + i) & r->mask];
+	atomic_store_explicit(&r->tail, tail + n, memory_order_release);
+	return n;
+}
 
-	product = v->phase * v->frac;
-	product >>= v->shift;
-	ix = product;
-	if (ix >= v->wave.nsamp)
-		ix = v->wave.nsamp - 1;
+/* ring_flush() - Consumer side, discard everything in ring
+ * @r: Pointer to word_ring
+ */
+static void ring_flush(struct word_ring *r)
+{
+	uint32_t head = atomic_load_explicit(&r->head, memory_order_acquire);
 
-	return (v->amp->mult * v->wave.samples[ix]) >> v->amp->shift;
+	r->head_cache = head;
+	atomic_store_explicit(&r->tail, head, memory_order_release);
 }
 
-#define	HOST_IN_WORDS	5000
+#define	HOST_IN_WORDS	4096	/* Must be a power of two */
+#define HOST_WORDS_PER_SLOT	32	/* Host words taken per word time */
+#define PEEP_WINDOW	4	/* Words of lookahead for the optimizer */
+#define STOP_ABORT_NS	(3 * NSEC_PER_SEC)	/* Longest STOP discard */
+#define HOST_WORD_MASK	07777777	/* 21-bit PLATO output word */
+#define WORD_STAMP_SHIFT	21	/* Receive stamp above the word */
+#define WORD_STAMP_MASK	03777	/* Receive stamp, 11 bits */
+#define WORD_STAMP_NS_SHIFT	25	/* log2 ns per stamp unit, ~33.6ms */
 #define LDE_WAIT	5
 
 enum terminal_cmd_codes {
@@ -165,30 +576,231 @@ enum terminal_cmd_codes {
 	CMD_EXT = 7	/* Load External Channel */
 };
 
+/* struct gsw_state - GSW synthesizer state
+ * @cis: Count inhibit
+ * @vs: Voice specifier
+ * @vix: Voice index
+ * @voices: Voice generators
+ * @samples: Period of samples for snd_pcm_writei when not using mmap
+ * @acc: Accumulator for synth_block
+ * @written: Total frames written to the PCM
+ *
+ * In threaded audio mode this is owned by the audio thread and
+ * only changed through the GSW command queue.
+ */
+struct gsw_state {
+	uint8_t		cis;
+	uint8_t		vs;
+	uint8_t		vix;
+	struct gsw_voices voices;
+	int16_t		samples[SND_MAX_PERIOD * SND_CHANNELS];
+	uint32_t	acc[SND_MAX_PERIOD];
+	uint64_t	written;
+};
+
+#define GSW_Q_WORDS	256	/* GSW command queue size, power of two */
+
+/* struct audio_clock - Audio position, published by the PCM writer
+ * @seq: Sequence count, odd while an update is in progress
+ * @played: Frames played by the card
+ * @stamp: CLOCK_MONOTONIC time in ns when @played was sampled, 0 if
+ *	audio has not started
+ */
+struct audio_clock {
+	_Atomic uint32_t seq;
+	_Atomic uint64_t played;
+	_Atomic uint64_t stamp;
+};
+
+#define WORD_MAX_LAG	(4 * FRAMES_PER_WORD)	/* Word times to catch up */
+#define AUDIO_STALL_PERIODS	8	/* Periods without audio clock update */
+#define AUDIO_WAIT_TIMEOUTS	3	/* snd_pcm_wait() timeouts in a row */
+
+#define PLL_KP		(1.0 / 16)	/* Phase gain of the drift PLL */
+#define PLL_KI		(1.0 / 512)	/* Frequency gain of the drift PLL */
+#define PLL_MAX_ERR	10000000	/* ns of error before relocking */
+#define JITTER_BINS	16	/* Bins of log2 microseconds */
+
+/* struct clock_pll - Drift of the audio clock against CLOCK_MONOTONIC
+ * @locked: Reference has been taken
+ * @ref_mono: CLOCK_MONOTONIC time in ns of the reference sample
+ * @ref_audio: Audio time in ns of the reference sample
+ * @last_mono: CLOCK_MONOTONIC time of the previous sample
+ * @offset: Filtered monotonic less audio time since the reference, ns
+ * @slope: Filtered rate of change of @offset
+ * @samples: Samples taken since the last lock
+ * @relocks: Times the error was too large and the reference retaken
+ * @jitter: Histogram of absolute phase error, bin n counts errors
+ *	below 2^n microseconds, the last bin counts the rest
+ *
+ * The audio clock runs slow by slope * 10^6 ppm.
+ */
+struct clock_pll {
+	bool		locked;
+	uint64_t	ref_mono;
+	uint64_t	ref_audio;
+	uint64_t	last_mono;
+	double		offset;
+	double		slope;
+	uint32_t	samples;
+	uint32_t	relocks;
+	uint32_t	jitter[JITTER_BINS];
+};
+
+struct host_session;
+
+/* struct clock_source - Source of terminal word times
+ * @name: Name used with -C
+ * @audio: Needs the PCM, the timer source is used while it is down
+ * @run: Run word times that are due and set the word timer for the next
+ */
+struct clock_source {
+	const char	*name;
+	bool		audio;
+	void		(*run)(struct host_session *sess);
+};
+
 enum host_states { in_sync, out_of_sync };
 
+enum host_conn {
+	HOST_DOWN,		/* Waiting to retry */
+	HOST_CONNECTING,	/* Looking up and connecting */
+	HOST_UP,		/* Connected */
+};
+
+#define HOST_BACKOFF_MIN_MS	500	/* First reconnect delay */
+#define HOST_BACKOFF_MAX_MS	30000	/* Longest reconnect delay */
+#define HOST_CONNECT_NS	(10 * NSEC_PER_SEC)	/* Time to get connected */
+#define HOST_RACE_NS	(250 * 1000000ULL)	/* Delay between connects */
+#define HOST_ADDRS	16	/* Addresses kept to try */
+#define HOST_RACE	4	/* Connects in progress at once */
+
+/* struct host_addr - Address to try connecting to the host on
+ * @sa: Socket address
+ * @len: Length of @sa
+ */
+struct host_addr {
+	struct sockaddr_storage sa;
+	socklen_t	len;
+};
+
+#define HOST_FRAME_SIZE	3	/* Bytes per host word */
+#define HOST_RX_BUF	4096	/* Host receive buffer size */
+#define HOST_TX_BUF	1024	/* Host key queue size in bytes */
+
+enum flow_state {
+	FLOW_ON,		/* Host may send */
+	FLOW_OFF,		/* XOFF sent, waiting to drain to XON mark */
+};
+
+/* struct flow_ctl - Host flow control
+ * @state: Whether the host has been sent XOFF
+ * @xoff_mark: Ring fill at which XOFF is sent
+ * @xon_mark: Ring fill at which XON is sent, below @xoff_mark
+ * @last_count: Ring fill after the last receive
+ * @trend: Average change of ring fill per receive, in 1/16 words
+ * @xoff_at: CLOCK_MONOTONIC time XOFF was last sent
+ */
+struct flow_ctl {
+	enum flow_state	state;
+	uint32_t	xoff_mark;
+	uint32_t	xon_mark;
+	uint32_t	last_count;
+	int32_t		trend;
+	uint64_t	xoff_at;
+};
+
+#define SUBSYS_BACKOFF_MIN_MS	50	/* First reopen delay */
+#define SUBSYS_BACKOFF_MAX_MS	10000	/* Longest reopen delay */
+
+/* struct subsys - Device reopened by plato_if when it fails
+ * @name: Name used in messages and stats
+ * @open: Open the device, returns 0 on success or -1 on error
+ * @close: Release the device, also after a partial open
+ * @sess: Pointer to host_session passed to @open and @close
+ * @timer_fd: Timer for the next reopen
+ * @up: Device is open and working
+ * @backoff_ms: Next reopen delay
+ * @failures: Times the device failed or could not be opened
+ * @restarts: Times the device was reopened after failing
+ */
+struct subsys {
+	const char	*name;
+	int		(*open)(struct host_session *sess);
+	void		(*close)(struct host_session *sess);
+	struct host_session *sess;
+	int		timer_fd;
+	bool		up;
+	unsigned int	backoff_ms;
+	uint32_t	failures;
+	uint32_t	restarts;
+};
+
 struct host_session {
 	int		fd;		/* File descriptor for session */
 	int		spi_fd;		/* SPI file descriptor */
 	int		snd_fd;		/* Sound file descriptor */
 	enum host_states host_state;
-	uint16_t	erase_abort_count;
-	uint16_t	inwd_in;
-	uint16_t	inwd_out;
+	enum host_conn	conn;
+	int		host_timer_fd;	/* Reconnect and connect timeouts */
+	unsigned int	backoff_ms;	/* Next reconnect delay */
+	struct gaicb	gai;		/* Asynchronous name lookup */
+	struct addrinfo	gai_hints;
+	bool		resolving;	/* Name lookup in progress */
+	uint64_t	connect_end;	/* CLOCK_MONOTONIC connect deadline */
+	struct host_addr addrs[HOST_ADDRS];	/* Addresses to try */
+	unsigned int	n_addrs;
+	unsigned int	next_addr;	/* Next of addrs to try */
+	int		race_fd[HOST_RACE];	/* Connects in progress */
+	uint8_t		race_addr[HOST_RACE];	/* Address of each connect */
+	bool		net_ready;	/* A default route exists */
+	bool		was_up;		/* Has been connected to the host */
+	const char	*status;	/* Status message on the terminal */
+	struct word_ring inwd;		/* Words from host, with stamps */
+	uint32_t	clear_pos;	/* Ring position of last screen clear */
+	uint32_t	delay_skip;	/* Words queued over an SPI outage */
+	uint32_t	held_word;	/* Word taken but not yet sent */
+	bool		word_held;	/* held_word is valid */
+	bool		clear_valid;	/* clear_pos has not been sent yet */
+	uint8_t		clear_mode;	/* Mode set by the screen clear */
+	uint32_t	status_end;	/* Ring position after status text */
+	bool		status_valid;	/* status_end has not been sent yet */
+	uint8_t		status_mode;	/* Mode at status_end */
+	struct flow_ctl	flow;
+	bool		stop_abort;	/* Discarding output after STOP */
+	uint8_t		stop_mode;	/* Mode when STOP was pressed */
+	uint8_t		queued_mode;	/* Mode set by the last LDM queued */
+	uint64_t	stop_end;	/* CLOCK_MONOTONIC limit of stop_abort */
 	uint32_t	inwds[HOST_IN_WORDS];
 	int32_t		pending_echo;
 	uint32_t	gsw_words[32];
 	uint32_t	gsw_cnt;
 	uint8_t		current_mode;
-	uint8_t		cis;		/* GSW count inhibit */
-	uint8_t		vs;		/* Voice specifier */
-	uint8_t		vix;		/* Voice index */
 	uint8_t		wc;		/* Word count */
 	uint8_t		inhibit;	/* Input inhibit */
 	snd_async_handler_t *pcm_handler;
-	int16_t		samples[FRAMES_PER_PERIOD * SND_CHANNELS];
-	struct voice	voices[VOICES];
+	struct gsw_state gsw;
+	struct word_ring gsw_q;		/* GSW commands to audio thread */
+	uint32_t	gsw_qwords[GSW_Q_WORDS];
+	int		tick_fd;	/* eventfd for audio thread periods */
+	pthread_t	audio_tid;
+	bool		audio_running;	/* audio_tid owns the PCM */
+	atomic_bool	audio_stop;	/* Asks audio_tid to exit */
+	atomic_bool	audio_failed;	/* audio_tid exited on a PCM error */
+	struct subsys	pcm;		/* PCM device */
+	struct subsys	spi;		/* SPI device */
+	struct audio_clock aclock;
+	const struct clock_source *clock;
+	const struct clock_source *clock_want;	/* Source used with the PCM */
+	int		word_timer_fd;	/* Timer for the next word time */
+	uint64_t	clock_base;	/* CLOCK_MONOTONIC start of timer clock */
+	uint64_t	next_word;	/* Frame time the next word is due at */
+	uint64_t	last_stamp;	/* Audio clock sample fed to the PLL */
+	struct clock_pll pll;
+	bool		words_started;
 	uint32_t	lde_count;
+	uint32_t	last_ldm;	/* Last LDM sent to terminal, 0 if none */
+	bool		upgrade;	/* upgrade_exec requested */
 #if NO_TERMINAL
 	uint16_t	next_key;
 	uint16_t	next_time;
@@ -198,38 +810,239 @@ struct host_session {
 	bool		key_stop_search;
 #endif /* NO_TERMINAL */
 	uint8_t		spi_buf[6];
+	uint16_t	rx_len;		/* Bytes held in rx_buf */
+	uint8_t		rx_buf[HOST_RX_BUF];
+	uint16_t	tx_len;		/* Bytes queued in tx_buf */
+	bool		tx_blocked;	/* Waiting for POLLOUT */
+	uint8_t		tx_buf[HOST_TX_BUF];
+};
+
+#define HIST_SUB_BITS	2	/* log2 linear bins per power of two */
+#define HIST_BINS	64	/* Exact below 2^HIST_SUB_BITS, to 2^16 */
+
+/* struct hist - Log-linear histogram
+ * @count: Values recorded
+ * @max: Largest value recorded
+ * @sum: Sum of values recorded
+ * @bins: Bins below 2^HIST_SUB_BITS hold one value, each power of two
+ *	above that is split in 2^HIST_SUB_BITS bins of equal width
+ */
+struct hist {
+	uint32_t	count;
+	uint32_t	max;
+	uint64_t	sum;
+	uint32_t	bins[HIST_BINS];
 };
 
+/* enum word_class - Host words told apart in the delay histograms */
+enum word_class {
+	WORD_DATA,
+	WORD_LDC,
+	WORD_LDM,
+	WORD_GSW,
+	WORD_ECHO,
+	WORD_OTHER,
+	WORD_CLASSES
+};
+
+static const char *const word_class_names[WORD_CLASSES] = {
+	[WORD_DATA] = "data",
+	[WORD_LDC] = "ldc",
+	[WORD_LDM] = "ldm",
+	[WORD_GSW] = "gsw",
+	[WORD_ECHO] = "echo",
+	[WORD_OTHER] = "other",
+};
+
+/* struct plato_stats - Counters and gauges for dump_stats and the stats
+ * socket
+ *
+ * Each field has one writer, so updates are plain stores. Those written
+ * by the thread that owns the PCM are atomic and on their own cache
+ * line, so the protocol thread can read them without locking and does
+ * not share the line with the audio thread.
+ */
+struct plato_stats {
+	uint32_t	connects;	/* Successful connections */
+	uint32_t	resync_count;	/* Times host framing was lost */
+	uint32_t	resync_bytes;	/* Bytes skipped to regain framing */
+	uint32_t	ring_high;	/* Most words held in the host ring */
+	uint32_t	overflows;	/* Host words lost to a full ring */
+	uint32_t	words_skipped;	/* Word times dropped after a stall */
+	uint32_t	slots;		/* Word times sent to the terminal */
+	uint32_t	slots_filler;	/* Word times that sent a plain NOP */
+	uint32_t	slots_saved;	/* Local words that used no word time */
+	uint32_t	peep_saved;	/* Words removed by the optimizer */
+	uint32_t	erase_dropped;	/* Words dropped before a clear */
+	uint32_t	stop_dropped;	/* Words discarded after STOP */
+	uint32_t	spi_errors;	/* Failed SPI transfers */
+	uint32_t	tx_keys;	/* Keys queued */
+	uint32_t	tx_writes;	/* Writes to the host */
+	uint32_t	tx_drops;	/* Keys lost to a full queue */
+	uint32_t	xoffs;		/* XOFF sent on reaching the XOFF mark */
+	uint32_t	early_xoffs;	/* XOFF sent early because of the trend */
+	uint32_t	xoff_retries;	/* XOFF sent again, host kept sending */
+	uint32_t	xons;		/* XON sent */
+	uint32_t	gsw_q_drops;	/* GSW commands lost to full queue */
+	struct hist	word_delay[WORD_CLASSES];	/* Stamp units queued */
+	struct hist	ring_fill;	/* Words queued at each word time */
+	_Atomic uint64_t xruns __attribute__((aligned(64)));	/* Underruns */
+	_Atomic uint64_t pcm_errors;	/* Other PCM write errors */
+	_Atomic uint64_t synth_periods;	/* Periods synthesized */
+	_Atomic uint64_t synth_ns;	/* Thread CPU time synthesizing */
+	_Atomic uint64_t synth_max_ns;	/* Longest synthesis of a period */
+} __attribute__((aligned(64)));
+
+static struct plato_stats stats;
+
+/* stat_add() - Add to a counter written by the PCM owner
+ * @c: Counter in stats
+ * @n: Amount to add
+ *
+ * There is only one writer, so no atomic read-modify-write is needed.
+ */
+static inline void stat_add(_Atomic uint64_t *c, uint64_t n)
+{
+	atomic_store_explicit(c, atomic_load_explicit(c, memory_order_relaxed) +
+			      n, memory_order_relaxed);
+}
+
+/* hist_bin() - Return the histogram bin for a value
+ * @v: Value
+ */
+static unsigned int hist_bin(uint32_t v)
+{
+	unsigned int msb = HIST_SUB_BITS;
+	unsigned int bin;
+
+	if (v < (1U << HIST_SUB_BITS))
+		return v;
+	while (v >> (msb + 1))
+		++msb;
+	bin = (msb - HIST_SUB_BITS + 1) << HIST_SUB_BITS |
+	      ((v >> (msb - HIST_SUB_BITS)) & ((1U << HIST_SUB_BITS) - 1));
+	return bin < HIST_BINS ? bin : HIST_BINS - 1;
+}
+
+/* hist_bin_high() - Return the largest value counted in a bin
+ * @bin: Bin number
+ */
+static uint32_t hist_bin_high(unsigned int bin)
+{
+	unsigned int shift;
+
+	if (bin < (1U << HIST_SUB_BITS))
+		return bin;
+	shift = (bin >> HIST_SUB_BITS) - 1;
+	return ((((1U << HIST_SUB_BITS) | (bin & ((1U << HIST_SUB_BITS) - 1)))
+		 + 1) << shift) - 1;
+}
+
+/* hist_record() - Count a value in a histogram
+ * @h: Pointer to hist
+ * @v: Value
+ */
+static void hist_record(struct hist *h, uint32_t v)
+{
+	++h->bins[hist_bin(v)];
+	++h->count;
+	h->sum += v;
+	if (v > h->max)
+		h->max = v;
+}
+
+/* hist_quantile() - Estimate a quantile of a histogram
+ * @h: Pointer to hist
+ * @q: Quantile, 0 to 1
+ *
+ * Returns the top of the bin holding the quantile, no more than the
+ * largest value recorded, so the estimate errs high by less than a bin.
+ */
+static uint32_t hist_quantile(const struct hist *h, double q)
+{
+	uint64_t rank = q * h->count + 0.999999;
+	uint64_t seen = 0;
+	unsigned int i;
+
+	if (!rank)
+		rank = 1;
+	for (i = 0; i < HIST_BINS; ++i) {
+		seen += h->bins[i];
+		if (seen >= rank)
+			return hist_bin_high(i) < h->max ?
+			       hist_bin_high(i) : h->max;
+	}
+	return h->max;
+}
+
 /* setamp - Set amplitude on voice
- * @sess: Pointer to host_session
+ * @g: Pointer to gsw_state
  * @vix: Index to voice to set
  * @ampix: GSW vaolume index (0 - 7)
  */
-static void setamp(struct host_session *sess, int vix, int ampix)
+static void setamp(struct gsw_state *g, int vix, int ampix)
 {
-	sess->voices[vix].amp = &amp[ampix];
+	g->voices.amp[vix] = &amp[ampix];
+	voice_level(&g->voices, vix);
 }
 
-/* setdiv() - Set divisor for voice
- * @sess: Pointer to host_session
+/* setpitch() - Set pitch for voice
+ * @g: Pointer to gsw_state
+ * @vix: Index to voice to set
+ * @ext: 15-bit GSW ext value
+ */
+static void setpitch(struct gsw_state *g, int vix, uint32_t ext)
+{
+	g->voices.incr[vix] = dds_incr[ext & 0x7FFF];
+}
+
+/* setwave() - Set waveform for voice
+ * @g: Pointer to gsw_state
  * @vix: Index to voice to set
- * @div: Divisor to set
+ * @wave: Waveform to use
+ */
+static void setwave(struct gsw_state *g, int vix, const struct wave *wave)
+{
+	g->voices.wave[vix] = *wave;
+	voice_level(&g->voices, vix);
+}
+
+/* gsw_apply() - Apply a GSW command to the synthesizer
+ * @g: Pointer to gsw_state
+ * @word: 21-bit PLATO output word holding CMD_AUD or CMD_EXT
  */
-static void setdiv(struct host_session *sess, int vix, int div)
+static void gsw_apply(struct gsw_state *g, uint32_t word)
 {
-	struct voice *v = &sess->voices[vix];
-	uint16_t step;
+	uint32_t data = (word >> 1) & 0x7FFF;	/* Extract only the data */
+
+	switch ((word >> 16) & 7) {
+	case CMD_AUD:		/* If audio command */
+		if ((word & 0x7800)) {	/* If not GSW NOP */
+			g->cis = (data & 0x8000) != 0;
+			g->vix = g->vs = (data >> 12) & 3;
+			setamp(g, 0, (data >> 9) & 7);
+			setamp(g, 1, (data >> 6) & 7);
+			setamp(g, 2, (data >> 3) & 7);
+			setamp(g, 3, data & 7);
+		}
+		break;
 
-	v->div = div;
-	step = (div + v->wave.nsamp - 1) / v->wave.nsamp;
-	v->step = step;
-	v->frac = frac_gen(step, &v->shift);
+	case CMD_EXT:		/* If ext command */
+		setpitch(g, g->vix, data);
+		if (!g->cis) {
+			if (g->vix)
+				--g->vix;
+			else
+				g->vix = g->vs;
+		}
+		break;
+	}
 }
 
-#define XOFF1LIMIT ((2 * HOST_IN_WORDS) / 3)
-#define XOFF2LIMIT ((3 * HOST_IN_WORDS) / 4)
-#define XON1LIMIT (HOST_IN_WORDS / 3)
-#define XON2LIMIT (HOST_IN_WORDS / 4)
+#define XOFF1LIMIT ((2 * HOST_IN_WORDS) / 3)	/* Default XOFF watermark */
+#define XON1LIMIT (HOST_IN_WORDS / 3)		/* Default XON watermark */
+#define FLOW_LOOKAHEAD	4	/* Receive batches of trend to look ahead */
+#define FLOW_RETRY_NS	(250 * 1000000ULL)	/* XOFF retransmit interval */
 
 extern char *optarg;
 extern int optind;
@@ -238,77 +1051,344 @@ extern int opterr;
 extern int optreset;
 
 static int debug_flag;
+static bool peephole;		/* Remove words that cannot change the display */
+static bool audio_threaded;	/* Synthesize audio on its own thread */
+static int audio_cpu = -1;	/* CPU to pin audio thread to */
+
+#define AUDIO_RT_PRIO	70	/* SCHED_FIFO priority of audio thread */
 
 static const char *port = "5004";	/* Default port number */
 static const char *host = "cyberserv.org";
 static const char *spi_dev = "/dev/spidev1.0";
+static const char *ctl_path = "/run/plato_if.ctl";
+static const char *stats_path = "/run/plato_if.stats";
+static const char *cache_path = "/var/lib/plato_if.addr";
 static uint32_t	spi_speed = 5040;
+static const char *obs_name = "/plato_if";	/* Observer shared memory */
 
 static struct host_session sess = {
+	.fd = -1,
+	.race_fd = { -1, -1, -1, -1 },
 	.pending_echo = -1,
+	.flow = {
+		.xoff_mark = XOFF1LIMIT,
+		.xon_mark = XON1LIMIT,
+	},
+	.spi_fd = -1,
+	.snd_fd = -1,
+	.tick_fd = -1,
+	.word_timer_fd = -1,
 };
 
 static snd_pcm_t *snd_ph;	/* Playback handle */
 static snd_pcm_hw_params_t *snd_hw_params;
 static snd_pcm_stream_t stream = SND_PCM_STREAM_PLAYBACK;
-static const char pcm_name[] = "hw:0,0";
-
+static const char *pcm_name = "hw:0,0";
+static unsigned int snd_channels = SND_CHANNELS;
+static unsigned int snd_period_frames = FRAMES_PER_PERIOD;
+static unsigned int snd_periods = SND_PERIODS;
+static bool snd_mmap;		/* Synthesize straight into the PCM buffer */
+
+#define MAX_EVENTS	8	/* Events handled per epoll_wait */
+#define MAX_FDS		256	/* Highest fd + 1 that can be registered */
+
+/* struct fd_proc - Handler registered for a file descriptor
+ * @poll: Function called when the descriptor has events
+ * @data: Private data passed to @poll
+ * @pfd: Poll state handed to @poll, revents filled in from epoll
+ *
+ * A pointer to this structure is stored in the epoll event data so
+ * that dispatch is a direct call, no matter how many fds are open.
+ * An unregistered handler has its fd set to -1 and is kept on a free
+ * list until do_poll has finished with the current batch of events.
+ */
 struct fd_proc {
 	void	(*poll)(void *data, struct pollfd *);
 	void	*data;
+	struct pollfd	pfd;
+	struct fd_proc	*next_free;
 };
 
-static struct fd_proc	*fd_proc;
-static struct pollfd	*fds;
-static int nfds;
+static int epoll_fd = -1;
+static struct fd_proc *fd_procs[MAX_FDS];
+static struct fd_proc *fd_procs_free;
+
+/* open_poll() - Create the epoll instance used by do_poll
+ *
+ * Returns 0 on success, -1 on error
+ */
+static int open_poll(void)
+{
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd < 0) {
+		int err = errno;
+
+		fprintf(stderr, "%s: epoll_create1 failed, errno=%d\n",
+			__func__, err);
+		errno = err;
+		return -1;
+	}
+	return 0;
+}
 
 static void
 register_fd(int fd, void (*func)(void *, struct pollfd *), int events, void *data)
 {
-	++nfds;
-	if (!fd_proc) {
-		fd_proc = malloc(nfds * sizeof(*fd_proc));
-		fds = malloc(nfds * sizeof(*fds));
-	} else {
-		fd_proc = realloc(fd_proc, nfds * sizeof(*fd_proc));
-		fds = realloc(fds, nfds * sizeof(*fds));
+	struct epoll_event ev;
+	struct fd_proc *proc;
+
+	if (fd < 0 || fd >= MAX_FDS) {
+		fprintf(stderr, "%s: fd %d out of range\n", __func__, fd);
+		exit(1);
 	}
-	if (!fd_proc || !fds) {
+	proc = malloc(sizeof(*proc));
+	if (!proc) {
 		fprintf(stderr, "%s: malloc failure\n", __func__);
 		exit(1);
 	}
-	fd_proc[nfds - 1].poll = func;
-	fd_proc[nfds - 1].data = data;
-	fds[nfds - 1].fd = fd;
-	fds[nfds - 1].events = events;
-	fds[nfds - 1].revents = 0;
+	proc->poll = func;
+	proc->data = data;
+	proc->pfd.fd = fd;
+	proc->pfd.events = events;
+	proc->pfd.revents = 0;
+	proc->next_free = NULL;
+
+	/* The POLL* and EPOLL* event bits have the same values */
+	ev.events = events;
+	ev.data.ptr = proc;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		fprintf(stderr, "%s: epoll_ctl failed for fd %d: %m\n",
+			__func__, fd);
+		exit(1);
+	}
+	fd_procs[fd] = proc;
 }
 
-static int do_poll(int timeout)
+/* unregister_fd() - Stop dispatching events for a file descriptor
+ * @fd: File descriptor passed to register_fd
+ *
+ * Must be called before @fd is closed. Does nothing if @fd is not
+ * registered.
+ */
+static void unregister_fd(int fd)
 {
-	int ix;
-	int n;
+	struct fd_proc *proc;
 
-	n = poll(fds, nfds, timeout);
-	if (n < 0) {
-		int err = errno;
+	if (fd < 0 || fd >= MAX_FDS || !fd_procs[fd])
+		return;
+	proc = fd_procs[fd];
+	fd_procs[fd] = NULL;
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+	proc->pfd.fd = -1;
+	proc->next_free = fd_procs_free;
+	fd_procs_free = proc;
+}
 
-		fprintf(stderr, "%s: poll error, errno=%d\n", __func__, err);
-		errno = err;
-		return -1;
-	}
-	if (n == 0)
-		return 0;
+/* modify_fd() - Change the events polled for a file descriptor
+ * @fd: File descriptor passed to register_fd
+ * @events: New poll events
+ */
+static void modify_fd(int fd, int events)
+{
+	struct epoll_event ev;
+	struct fd_proc *proc;
 
-	for (ix = 0; ix < nfds; ++ix) {
-		if (fds[ix].revents) {
-			fd_proc[ix].poll(fd_proc[ix].data, &fds[ix]);
-			fds[ix].revents = 0;
-		}
+	if (fd < 0 || fd >= MAX_FDS || !fd_procs[fd])
+		return;
+	proc = fd_procs[fd];
+	proc->pfd.events = events;
+	ev.events = events;
+	ev.data.ptr = proc;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev) < 0)
+		fprintf(stderr, "%s: epoll_ctl failed for fd %d: %m\n",
+			__func__, fd);
+}
+
+/* do_poll() - Wait for events and dispatch them
+ * @timeout: Milliseconds to wait, -1 to wait forever
+ *
+ * Returns number of events handled, 0 on timeout or -1 on error
+ */
+static int do_poll(int timeout)
+{
+	struct epoll_event events[MAX_EVENTS];
+	int ix;
+	int n;
+
+	n = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout);
+	if (n < 0) {
+		int err = errno;
+
+		if (err == EINTR)
+			return 0;
+		fprintf(stderr, "%s: poll error, errno=%d\n", __func__, err);
+		errno = err;
+		return -1;
+	}
+
+	for (ix = 0; ix < n; ++ix) {
+		struct fd_proc *proc = events[ix].data.ptr;
+
+		if (proc->pfd.fd < 0)
+			continue;
+		proc->pfd.revents = events[ix].events;
+		proc->poll(proc->data, &proc->pfd);
+		proc->pfd.revents = 0;
+	}
+
+	while (fd_procs_free) {
+		struct fd_proc *proc = fd_procs_free;
+
+		fd_procs_free = proc->next_free;
+		free(proc);
 	}
 	return n;
 }
 
+/* mono_ns() - Return CLOCK_MONOTONIC time in nanoseconds
+ */
+static uint64_t mono_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+/* open_timer() - Create a CLOCK_MONOTONIC timer handled by do_poll
+ * @func: Function to call when the timer expires
+ * @data: Private data passed to @func
+ *
+ * Returns the timerfd, or exits on failure
+ */
+static int open_timer(void (*func)(void *, struct pollfd *), void *data)
+{
+	int fd;
+
+	fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (fd < 0) {
+		fprintf(stderr, "%s: timerfd_create failed: %m\n", __func__);
+		exit(1);
+	}
+	register_fd(fd, func, POLLIN, data);
+	return fd;
+}
+
+/* arm_timer() - Set a one-shot timer to an absolute time
+ * @fd: Timer from open_timer
+ * @when: CLOCK_MONOTONIC expiry time in ns, 0 to disarm
+ */
+static void arm_timer(int fd, uint64_t when)
+{
+	struct itimerspec its = {
+		.it_value = {
+			.tv_sec = when / NSEC_PER_SEC,
+			.tv_nsec = when % NSEC_PER_SEC,
+		},
+	};
+
+	if (timerfd_settime(fd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+		fprintf(stderr, "%s: timerfd_settime failed: %m\n", __func__);
+}
+
+/* read_timer() - Consume a timer expiration
+ * @fd: Timer from open_timer
+ *
+ * Returns number of expirations since the last read
+ */
+static uint64_t read_timer(int fd)
+{
+	uint64_t expirations;
+
+	if (read(fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+		return 0;
+	return expirations;
+}
+
+/* subsys_retry() - Set the timer to reopen a subsystem after its backoff
+ * @sub: Pointer to subsys
+ */
+static void subsys_retry(struct subsys *sub)
+{
+	if (!sub->backoff_ms)
+		sub->backoff_ms = SUBSYS_BACKOFF_MIN_MS;
+	fprintf(stderr, "%s: reopening in %u ms\n", sub->name, sub->backoff_ms);
+	arm_timer(sub->timer_fd, mono_ns() + sub->backoff_ms * 1000000ULL);
+	sub->backoff_ms *= 2;
+	if (sub->backoff_ms > SUBSYS_BACKOFF_MAX_MS)
+		sub->backoff_ms = SUBSYS_BACKOFF_MAX_MS;
+}
+
+/* subsys_start() - Open a subsystem, retrying later if it fails
+ * @sub: Pointer to subsys
+ *
+ * Returns 0 if the subsystem is up, -1 if a reopen is scheduled
+ */
+static int subsys_start(struct subsys *sub)
+{
+	if (sub->open(sub->sess) < 0) {
+		sub->close(sub->sess);
+		++sub->failures;
+		subsys_retry(sub);
+		return -1;
+	}
+	if (sub->failures) {
+		fprintf(stderr, "%s: reopened\n", sub->name);
+		++sub->restarts;
+	}
+	sub->up = true;
+	sub->backoff_ms = 0;
+	return 0;
+}
+
+/* subsys_failed() - Close a subsystem that failed and schedule a reopen
+ * @sub: Pointer to subsys
+ *
+ * Safe to call from the subsystem's own handlers, do_poll does not free
+ * their fd_proc until it has finished the current batch of events.
+ */
+static void subsys_failed(struct subsys *sub)
+{
+	if (!sub->up)
+		return;
+	fprintf(stderr, "%s: device failed\n", sub->name);
+	sub->up = false;
+	++sub->failures;
+	sub->close(sub->sess);
+	subsys_retry(sub);
+}
+
+/* subsys_timer_poll() - Reopen a subsystem when its backoff expires
+ * @data: Pointer to subsys
+ * @pfd: Poll state for the timer
+ */
+static void subsys_timer_poll(void *data, struct pollfd *pfd)
+{
+	struct subsys *sub = data;
+
+	if (read_timer(pfd->fd) && !sub->up)
+		subsys_start(sub);
+}
+
+/* subsys_init() - Set up a supervised subsystem
+ * @sub: Pointer to subsys
+ * @name: Name used in messages and stats
+ * @open_fn: Open the device, returns 0 on success or -1 on error
+ * @close_fn: Release the device, also after a partial open
+ * @sess: Pointer to host_session
+ */
+static void subsys_init(struct subsys *sub, const char *name,
+			int (*open_fn)(struct host_session *sess),
+			void (*close_fn)(struct host_session *sess),
+			struct host_session *sess)
+{
+	sub->name = name;
+	sub->open = open_fn;
+	sub->close = close_fn;
+	sub->sess = sess;
+	sub->timer_fd = open_timer(subsys_timer_poll, sub);
+}
+
 #if 0
 static long timediff(const struct timespec *last, const struct timespec *now)
 {
@@ -333,16 +1413,7 @@ static long timediff(const struct timespec *last, const struct timespec *now)
  */
 static unsigned int host_word_count(struct host_session *sess)
 {
-	int	diff = sess->inwd_in - sess->inwd_out;
-
-	if (diff < 0)
-		diff += ARRAY_SIZE(sess->inwds);
-	if (diff < 0) {
-		fprintf(stderr, "inwd_in/inwd_out inconsistency, in=%d, out=%d\n",
-			sess->inwd_in, sess->inwd_out);
-		sess->inwd_in = sess->inwd_out = diff = 0;
-	}
-	return diff;
+	return ring_count(&sess->inwd);
 }
 
 #define KEY_NEXT	026
@@ -375,27 +1446,260 @@ const char * const key_decode[02000] = {
 	[KEY_TURNON] = "-turnon-",
 };
 
-/* send_key() - Send key code to host
+#define OBS_MAGIC	0x504c4f42	/* "PLOB" */
+#define OBS_VERSION	1
+#define OBS_ENTRIES	4096	/* Must be a power of two */
+
+enum obs_type {
+	OBS_WORD = 1,		/* Word sent to the terminal */
+	OBS_KEY,		/* Key code queued to the host */
+	OBS_GSW,		/* GSW command from the host */
+};
+
+/* struct obs_entry - One event in the observer ring
+ * @seq: 2 * position + 1 while being written, 2 * position + 2 when done
+ * @stamp: CLOCK_MONOTONIC time in ns of the event
+ * @type: enum obs_type
+ * @data: Terminal word, key code or GSW word
+ */
+struct obs_entry {
+	_Atomic uint64_t seq;
+	_Atomic uint64_t stamp;
+	_Atomic uint32_t type;
+	_Atomic uint32_t data;
+};
+
+/* struct obs_ring - Shared memory ring of terminal events for observers
+ * @magic: OBS_MAGIC, stored last when the ring is set up
+ * @version: OBS_VERSION
+ * @entries: Number of @e, a power of two
+ * @head: Position of the next event to be written
+ * @e: Events, position p is in e[p % entries]
+ *
+ * plato_if is the only writer and never waits for readers. A reader
+ * keeps its own position p, starting at @head. Entry e[p % entries]
+ * holds position p once its @seq reads 2 * p + 2. The reader copies
+ * the entry, then reads @seq again; if it changed or is beyond
+ * 2 * p + 2 the writer has lapped the reader, which skips ahead to
+ * @head - @entries.
+ */
+struct obs_ring {
+	uint32_t	magic;
+	uint32_t	version;
+	uint32_t	entries;
+	uint32_t	pad;
+	_Atomic uint64_t head __attribute__((aligned(64)));
+	struct obs_entry e[OBS_ENTRIES] __attribute__((aligned(64)));
+};
+
+static struct obs_ring *obs;	/* Observer ring, NULL if none */
+
+/* obs_put() - Publish an event to observers
+ * @type: enum obs_type
+ * @data: Event data
+ */
+static void obs_put(enum obs_type type, uint32_t data)
+{
+	struct obs_entry *e;
+	uint64_t pos;
+
+	if (!obs)
+		return;
+	pos = atomic_load_explicit(&obs->head, memory_order_relaxed);
+	e = &obs->e[pos & (OBS_ENTRIES - 1)];
+	atomic_store_explicit(&e->seq, 2 * pos + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	atomic_store_explicit(&e->stamp, mono_ns(), memory_order_relaxed);
+	atomic_store_explicit(&e->type, type, memory_order_relaxed);
+	atomic_store_explicit(&e->data, data, memory_order_relaxed);
+	atomic_store_explicit(&e->seq, 2 * pos + 2, memory_order_release);
+	atomic_store_explicit(&obs->head, pos + 1, memory_order_release);
+}
+
+/* open_obs() - Create or reuse the observer shared memory
+ * @name: POSIX shared memory name, "" for none
+ *
+ * A ring left by an earlier plato_if of the same version, as after an
+ * upgrade, is continued so that attached observers carry on. Failure
+ * is reported but not fatal.
+ */
+static void open_obs(const char *name)
+{
+	struct obs_ring *r;
+	int fd;
+
+	if (!*name)
+		return;
+	fd = shm_open(name, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		fprintf(stderr, "Failed to open observer memory %s: %m\n",
+			name);
+		return;
+	}
+	if (ftruncate(fd, sizeof(*r)) < 0) {
+		fprintf(stderr, "%s: ftruncate failed: %m\n", __func__);
+		close(fd);
+		return;
+	}
+	r = mmap(NULL, sizeof(*r), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (r == MAP_FAILED) {
+		fprintf(stderr, "%s: mmap failed: %m\n", __func__);
+		return;
+	}
+	if (r->magic != OBS_MAGIC || r->version != OBS_VERSION ||
+	    r->entries != OBS_ENTRIES) {
+		r->magic = 0;
+		atomic_thread_fence(memory_order_release);
+		memset(r->e, 0, sizeof(r->e));
+		atomic_store(&r->head, 0);
+		r->version = OBS_VERSION;
+		r->entries = OBS_ENTRIES;
+		atomic_thread_fence(memory_order_release);
+		r->magic = OBS_MAGIC;
+	}
+	obs = r;
+}
+
+/* send_key() - Queue key code to send to host
  * @sess: PLATO host session
  * @key: PLATO key code to send
+ *
+ * Keys, echo replies and flow control are all queued here and sent
+ * together by host_flush, once per poll wakeup.
  */
 static void send_key(struct host_session *sess, uint16_t key)
 {
-	uint8_t keybuf[2];
-	int rc;
+	if (sizeof(sess->tx_buf) - sess->tx_len < 2) {
+		++stats.tx_drops;
+		fprintf(stderr, "key queue full, key %04o lost\n", key);
+		return;
+	}
+	sess->tx_buf[sess->tx_len++] = key >> 7;
+	sess->tx_buf[sess->tx_len++] = 0200 | key;
+	++stats.tx_keys;
+	obs_put(OBS_KEY, key);
+}
 
-	keybuf[0] = key >> 7;
-	keybuf[1] = 0200 | key;
-	rc = send(sess->fd, keybuf, sizeof(keybuf), MSG_NOSIGNAL);
-	if (rc != sizeof(keybuf)) {
-		if (rc < 0)
-			fprintf(stderr, "error on send - %m\n");
-		else
-			fprintf(stderr, "wrong size = %d\n", rc);
+/* host_flush() - Send queued keys to host
+ * @sess: PLATO host session
+ *
+ * Whatever the socket does not take stays queued, and POLLOUT is
+ * requested until it has all been sent.
+ */
+static void host_flush(struct host_session *sess)
+{
+	ssize_t rc;
+
+	if (!sess->tx_len || sess->conn != HOST_UP)
 		return;
+	rc = send(sess->fd, sess->tx_buf, sess->tx_len,
+		  MSG_NOSIGNAL | MSG_DONTWAIT);
+	if (rc < 0) {
+		if (errno != EAGAIN && errno != EINTR) {
+			fprintf(stderr, "error on send - %m\n");
+			return;
+		}
+		rc = 0;
+	} else {
+		++stats.tx_writes;
+	}
+	sess->tx_len -= rc;
+	if (sess->tx_len && rc)
+		memmove(sess->tx_buf, &sess->tx_buf[rc], sess->tx_len);
+
+	if (!!sess->tx_len != sess->tx_blocked) {
+		sess->tx_blocked = !!sess->tx_len;
+		modify_fd(sess->fd, sess->tx_blocked ? POLLIN | POLLOUT :
+						       POLLIN);
+	}
+}
+
+/* flow_update() - Run host flow control after the ring fill changed
+ * @sess: Pointer to host_session
+ * @rx: True after words were received, false after words were removed
+ *
+ * XOFF is sent when the ring reaches the XOFF mark, or earlier if the
+ * trend of the fill over recent receives would take it there within
+ * FLOW_LOOKAHEAD receives. Early XOFF needs the ring above halfway
+ * between the marks, or the next word sent would be below the XON mark
+ * and XON would follow at once. XON is sent once the ring has drained to
+ * the XON mark, whether by sending words, erase compaction or STOP.
+ * If words keep arriving and the ring keeps filling after XOFF, XOFF
+ * is sent again every FLOW_RETRY_NS.
+ */
+static void flow_update(struct host_session *sess, bool rx)
+{
+	struct flow_ctl *fc = &sess->flow;
+	uint32_t count = host_word_count(sess);
+	uint64_t now;
+
+	if (rx) {
+		int32_t delta = (int32_t)(count - fc->last_count);
+
+		fc->trend += delta - fc->trend / 16;
+		fc->last_count = count;
+	}
+
+	switch (fc->state) {
+	case FLOW_ON:
+		if (count >= fc->xoff_mark) {
+			++stats.xoffs;
+		} else if (rx && fc->trend > 0 &&
+			   count > fc->xon_mark +
+			   (fc->xoff_mark - fc->xon_mark) / 2 &&
+			   count + fc->trend * FLOW_LOOKAHEAD / 16 >=
+			   fc->xoff_mark) {
+			++stats.early_xoffs;
+		} else {
+			break;
+		}
+		if (debug_flag)
+			fprintf(stderr, "count=%u XOFF\n", count);
+		send_key(sess, KEY_XOFF);
+		fc->state = FLOW_OFF;
+		fc->xoff_at = mono_ns();
+		break;
+
+	case FLOW_OFF:
+		if (count <= fc->xon_mark) {
+			if (debug_flag)
+				fprintf(stderr, "count=%u XON\n", count);
+			send_key(sess, KEY_XON);
+			fc->state = FLOW_ON;
+			++stats.xons;
+			break;
+		}
+		if (!rx || fc->trend <= 0)
+			break;
+		now = mono_ns();
+		if (now - fc->xoff_at >= FLOW_RETRY_NS) {
+			send_key(sess, KEY_XOFF);
+			fc->xoff_at = now;
+			++stats.xoff_retries;
+		}
+		break;
 	}
 }
 
+/* flow_set_marks() - Change the flow control watermarks
+ * @sess: Pointer to host_session
+ * @xoff: Ring fill at which to send XOFF
+ * @xon: Ring fill at which to send XON
+ *
+ * Returns 0 on success, -1 if the marks are out of range
+ */
+static int flow_set_marks(struct host_session *sess, uint32_t xoff,
+			  uint32_t xon)
+{
+	if (xon >= xoff || xoff >= HOST_IN_WORDS)
+		return -1;
+	sess->flow.xoff_mark = xoff;
+	sess->flow.xon_mark = xon;
+	flow_update(sess, false);
+	return 0;
+}
+
 /* echo_handle() - Check for echo commands and handle them
  * @sess: Pointer to host_session structure
  * @word: Word to check
@@ -415,7 +1719,7 @@ static uint32_t echo_handle(struct host_session *sess, uint32_t word)
 		return word;
 
 	nwds = host_word_count(sess);
-	if (nwds > XOFF1LIMIT) {
+	if (nwds > (int16_t)sess->flow.xoff_mark) {
 		sess->pending_echo = (data & 0x7F) | 0x80;
 //		send_key(sess, KEY_XON);
 	} else {
@@ -433,38 +1737,24 @@ static uint32_t echo_handle(struct host_session *sess, uint32_t word)
  */
 static uint32_t gsw_handle(struct host_session *sess, uint32_t word)
 {
-	uint32_t data;
-
 	if (word & (1 << 19))		/* If a data word */
 		return word;		/* Always pass data words */
 
-	data = (word >> 1) & 0x7FFF;	/* Extract only the data */
 	switch ((word >> 16) & 7) {
 	case CMD_AUD:		/* If audio command */
-		if ((word & 0x7800)) {	/* If not GSW NOP */
-			sess->cis = (data & 0x8000) != 0;
-			sess->vix = sess->vs = (data >> 12) & 3;
-			setamp(sess, 0, (data >> 9) & 7);
-			setamp(sess, 1, (data >> 6) & 7);
-			setamp(sess, 2, (data >> 3) & 7);
-			setamp(sess, 3, data & 7);
-		}
-		break;
-
 	case CMD_EXT:		/* If ext command */
-		setdiv(sess, sess->vix, E2D(data & 0xFFFFF));
-		if (!sess->cis) {
-			if (sess->vix)
-				--sess->vix;
-			else
-				sess->vix = sess->vs;
-		}
 		break;
 
 	default:
 		return word;		/* Return original word for all else */
 	}
 
+	obs_put(OBS_GSW, word);
+	if (!sess->audio_running)
+		gsw_apply(&sess->gsw, word);
+	else if (!ring_put(&sess->gsw_q, word))
+		++stats.gsw_q_drops;
+
 	sess->gsw_words[sess->gsw_cnt++] = word;
 	if (sess->gsw_cnt >= ARRAY_SIZE(sess->gsw_words))
 		sess->gsw_cnt = 0;
@@ -472,6 +1762,24 @@ static uint32_t gsw_handle(struct host_session *sess, uint32_t word)
 	return 04000003;		/* Send NOP to terminal */
 }
 
+#define NOP_MASK_SPEC	077000	/* Special data */
+#define NOP_SETSTAT	042000	/* Set station number */
+#define NOP_PMDSTART	043000	/* Start streaming "Plato Meta Data" */
+#define NOP_PMDSTREAM	044000	/* Plato Meta Data stream */
+#define NOP_PMDSTOP	045000	/* Stop Plato Meta Data stream */
+#define NOP_FONTTYPE	050000	/* Font type */
+#define NOP_FONTSIZE	051000	/* Font size */
+#define NOP_FONTFLAG	052000	/* Font flags */
+#define NOP_FONTINFO	053000	/* Get last font character width/height */
+#define NOP_OSINFO	054000	/* Get OS type, 1=mac, 2=win, 3=linux */
+
+/* Special data of a NOP word, which is held shifted up by one */
+#define NOP_SPEC(w)	(((w) >> 1) & NOP_MASK_SPEC)
+
+_Static_assert(NOP_SPEC(04000000 | (NOP_PMDSTART << 1)) == NOP_PMDSTART,
+	       "PMD start NOP not recognized");
+_Static_assert(NOP_SPEC(04000003) == 0, "plain NOP taken as special");
+
 #if HOST_DECODE1 || HOST_DECODE2 || HOST_DECODE3
 /* chmem - Return possible characters
  *
@@ -495,17 +1803,6 @@ static const char *chmem(uint8_t ch)
         return strs[ch];
 }
 
-#define NOP_MASK_SPEC	077000	/* Special data */
-#define NOP_SETSTAT	042000	/* Set station number */
-#define NOP_PMDSTART	043000	/* Start streaming "Plato Meta Data" */
-#define NOP_PMDSTREAM	044000	/* Plato Meta Data stream */
-#define NOP_PMDSTOP	045000	/* Stop Plato Meta Data stream */
-#define NOP_FONTTYPE	050000	/* Font type */
-#define NOP_FONTSIZE	051000	/* Font size */
-#define NOP_FONTFLAG	052000	/* Font flags */
-#define NOP_FONTINFO	053000	/* Get last font character width/height */
-#define NOP_OSINFO	054000	/* Get OS type, 1=mac, 2=win, 3=linux */
-
 /* decode_nop() - Decode special NOP
  *
  * Returns true if special NOP
@@ -641,15 +1938,19 @@ static bool is_screen_clear(uint32_t w)
 	return false;
 }
 
-static bool is_abortable_command(struct host_session *sess, uint32_t w)
+/* is_abortable_command() - Check if a screen clear makes a word useless
+ * @mode: Terminal mode in effect for @w
+ * @w: 21-bit PLATO output word
+ */
+static bool is_abortable_command(uint8_t mode, uint32_t w)
 {
 	enum terminal_cmd_codes cmd = (w >> 16) & 7;
 
 	if (w & (1 << 19)) {	/* If not a command word */
 		w >>= 1;
-		if (sess->current_mode == 3 && (w & 0777700) == 0777700)
+		if (mode == 3 && (w & 0777700) == 0777700)
 			return false;
-		return sess->current_mode != 2;
+		return mode != 2;
 	}
 
 	switch (cmd) {
@@ -679,86 +1980,270 @@ static void track_mode(struct host_session *sess, uint32_t w)
 	sess->current_mode = (w >> 4) & 3;
 }
 
-/* get_host_word() - Get next host word from buffer
+/* track_queued_mode() - Follow the mode of the words being queued
  * @sess: Pointer to host_session
+ * @w: 21-bit PLATO output word being queued
  *
- * Returns next unaborted word to send to terminal
+ * This is the mode that words arriving from the host are in, which
+ * differs from current_mode while an LDM is queued.
  */
-static uint32_t get_host_word(struct host_session *sess)
+static void track_queued_mode(struct host_session *sess, uint32_t w)
 {
-	uint32_t word;
-	uint16_t tmp_out = sess->inwd_out;
+	if (w & (1 << 19))	/* If not a command word */
+		return;
+	if (((w >> 16) & 7) != CMD_LDM)
+		return;
+	sess->queued_mode = (w >> 4) & 3;
+}
 
-	do {
-		word = sess->inwds[tmp_out++];
-		if (tmp_out >= ARRAY_SIZE(sess->inwds))
-			tmp_out = 0;
-		if (!sess->erase_abort_count)
-			break;
-		if (is_screen_clear(word))
-			--sess->erase_abort_count;
-		if (!is_abortable_command(sess, word))
-			break;
-#if HOST_DECODE3
-		fprintf(stderr, "A\n");
-		decode_host_word(word);
-#endif /* HOST_DECODE3 */
-	} while (sess->erase_abort_count);
-	sess->inwd_out = tmp_out;
-	return word;
+/* word_stamp() - Return the receive stamp for the current time
+ *
+ * Stamps wrap after 2^36ns, longer than HOST_IN_WORDS word times, so
+ * while words are sent a queued word cannot be mistaken for a newer
+ * one. Words held while the SPI device is down can wait longer, their
+ * delays are not counted.
+ */
+static uint32_t word_stamp(void)
+{
+	return (mono_ns() >> WORD_STAMP_NS_SHIFT) & WORD_STAMP_MASK;
 }
 
-/* do_host_word() - Process any host word
+/* get_host_word() - Get next host word from buffer
  * @sess: Pointer to host_session
+ * @stamp: Set to the receive stamp of the word
  *
- * Returns any word to send to attached terminal
+ * Returns next word to send to terminal
  */
-static uint32_t do_host_word(struct host_session *sess)
+static uint32_t get_host_word(struct host_session *sess, uint32_t *stamp)
 {
 	uint32_t word;
-	int16_t nwds;
 
-	if (sess->inwd_in == sess->inwd_out)
+	if (!ring_get(&sess->inwd, &word)) {
+		*stamp = word_stamp();
 		return 04000003;
-
-	word = get_host_word(sess);
-	sess->wc = (sess->wc + 1) & 0177;
-#if HOST_DECODE2
-	decode_host_word(word);
-#endif /* HOST_DECODE2 */
-	track_mode(sess, word);
-	word = echo_handle(sess, word);
-	if (!word)
-		++sess->lde_count;
-	nwds = host_word_count(sess);
-	if (nwds < XOFF1LIMIT && sess->pending_echo != -1) {
-		send_key(sess, sess->pending_echo);
-		sess->pending_echo = -1;
 	}
-	if (nwds == XON1LIMIT || nwds == XON2LIMIT) {
-		fprintf(stderr, "nwds=%d ", nwds);
-		send_key(sess, KEY_XON);
-	}
-	if (!word)
-		return 0;
-#if NO_TERMINAL
-	if ((word & 07640000) == 04240000)
-		sess->wc = (word >> 7) & 0177;
-	if ((word & 07600000) == 04200000)
-		sess->inhibit = !!(word & 00100000);
-#endif /* NO_TERMINAL */
-	word = gsw_handle(sess, word);
-	return word;
+	*stamp = word >> WORD_STAMP_SHIFT;
+	return word & HOST_WORD_MASK;
 }
 
-#if NO_TERMINAL
-struct keys {
-	uint16_t delay;		/* Delay in 1/60th second intervals */
-	uint16_t key;		/* Key to send */
-};
+/* is_plain_nop() - Check for a NOP that carries nothing
+ * @w: 21-bit PLATO output word
+ */
+static bool is_plain_nop(uint32_t w)
+{
+	if (w & (1 << 19))	/* If not a command word */
+		return false;
+	return ((w >> 16) & 7) == CMD_NOP && !NOP_SPEC(w);
+}
 
-const struct keys keys[] = {
-	{ 5, KEY_TURNON },
+/* is_pmd_nop() - Check for a Plato Meta Data NOP
+ * @w: 21-bit PLATO output word
+ *
+ * These carry data for pterm and are ignored by a hardware terminal.
+ */
+static bool is_pmd_nop(uint32_t w)
+{
+	enum terminal_cmd_codes cmd = (w >> 16) & 7;
+
+	if (w & (1 << 19))	/* If not a command word */
+		return false;
+	if (cmd != CMD_NOP)
+		return false;
+	w = NOP_SPEC(w);
+	return w >= NOP_PMDSTART && w <= NOP_PMDSTOP;
+}
+
+/* peep_ldc_overwritten() - Check if a later LDC replaces this one
+ * @sess: Pointer to host_session
+ * @w: LDC word about to be sent
+ *
+ * Looks ahead in the ring past NOPs and LDC of the other axis, which do
+ * not use the coordinate, for an LDC of the same axis.
+ */
+static bool peep_ldc_overwritten(struct host_session *sess, uint32_t w)
+{
+	uint32_t next;
+	uint32_t i;
+
+	for (i = 0; i < PEEP_WINDOW; ++i) {
+		if (!ring_peek(&sess->inwd, i, &next))
+			return false;
+		next &= HOST_WORD_MASK;
+		if (next & (1 << 19))	/* If a data word */
+			return false;
+		switch ((next >> 16) & 7) {
+		case CMD_NOP:
+			continue;
+		case CMD_LDC:
+			if ((next ^ w) & (1 << 10))
+				continue;
+			return true;
+		default:
+			return false;
+		}
+	}
+	return false;
+}
+
+/* peep_redundant() - Check if a word cannot change the display
+ * @sess: Pointer to host_session
+ * @w: 21-bit PLATO output word about to be sent
+ *
+ * Removes an LDC that a following LDC overwrites, an LDM identical to
+ * the last one sent that neither erases nor loads the word count, and
+ * plain NOPs. Nothing is moved, so visible effects stay in order.
+ */
+static bool peep_redundant(struct host_session *sess, uint32_t w)
+{
+	if (w & (1 << 19))	/* If a data word */
+		return false;
+
+	switch ((w >> 16) & 7) {
+	case CMD_NOP:
+		return is_plain_nop(w);
+	case CMD_LDC:
+		return peep_ldc_overwritten(sess, w);
+	case CMD_LDM:
+		if (w == sess->last_ldm && !(w & 2) && !(w & (1 << 14)))
+			return true;
+		sess->last_ldm = w;
+		return false;
+	}
+	return false;
+}
+
+/* word_class() - Classify a host word for the delay histograms
+ * @w: 21-bit PLATO output word
+ */
+static enum word_class word_class(uint32_t w)
+{
+	if (w & (1 << 19))	/* If a data word */
+		return WORD_DATA;
+	switch ((w >> 16) & 7) {
+	case CMD_LDC:
+		return WORD_LDC;
+	case CMD_LDM:
+		return WORD_LDM;
+	}
+	return WORD_OTHER;
+}
+
+/* word_delay() - Count the time a host word spent queued
+ * @sess: Pointer to host_session
+ * @class: Class of the word
+ * @stamp: Receive stamp of the word
+ * @now: Stamp for the current time
+ */
+static void word_delay(struct host_session *sess, enum word_class class,
+		       uint32_t stamp, uint32_t now)
+{
+	if (sess->delay_skip) {
+		--sess->delay_skip;	/* Stamp may have wrapped */
+		return;
+	}
+	hist_record(&stats.word_delay[class],
+		    (now - stamp) & WORD_STAMP_MASK);
+}
+
+/* host_word_step() - Process the next host word
+ * @sess: Pointer to host_session
+ * @now: Receive stamp for the current time
+ * @local: Set true if the word was consumed here and need not be sent
+ *
+ * Returns the word to send to attached terminal
+ */
+static uint32_t host_word_step(struct host_session *sess, uint32_t now,
+			       bool *local)
+{
+	uint32_t stamp;
+	uint32_t word;
+	int16_t nwds;
+
+	*local = false;
+	word = get_host_word(sess, &stamp);
+	sess->wc = (sess->wc + 1) & 0177;
+#if HOST_DECODE2
+	decode_host_word(word);
+#endif /* HOST_DECODE2 */
+	track_mode(sess, word);
+	word = echo_handle(sess, word);
+	if (!word)
+		++sess->lde_count;
+	nwds = host_word_count(sess);
+	if (nwds < (int16_t)sess->flow.xoff_mark && sess->pending_echo != -1) {
+		send_key(sess, sess->pending_echo);
+		sess->pending_echo = -1;
+	}
+	flow_update(sess, false);
+	if (!word || is_pmd_nop(word)) {
+		word_delay(sess, word ? WORD_OTHER : WORD_ECHO, stamp, now);
+		*local = true;
+		return word;
+	}
+#if NO_TERMINAL
+	if ((word & 07640000) == 04240000)
+		sess->wc = (word >> 7) & 0177;
+	if ((word & 07600000) == 04200000)
+		sess->inhibit = !!(word & 00100000);
+#endif /* NO_TERMINAL */
+	if (gsw_handle(sess, word) != word) {
+		word_delay(sess, WORD_GSW, stamp, now);
+		*local = true;
+		return 04000003;
+	}
+	word_delay(sess, word_class(word), stamp, now);
+	if (peephole && peep_redundant(sess, word)) {
+		++stats.peep_saved;
+		*local = true;
+	}
+	return word;
+}
+
+/* do_host_word() - Process host words for one terminal word time
+ * @sess: Pointer to host_session
+ *
+ * Words that are handled here (echo, GSW and PMD) do not use up the
+ * terminal word time, so words are taken until one has to go to the
+ * terminal. At most HOST_WORDS_PER_SLOT are taken, to bound the time
+ * spent in one word time. The time each word waited since it was
+ * received, and the ring fill, are counted in the histograms. A word
+ * time that sends a plain NOP, ours or one the host queued, is filler.
+ *
+ * Returns the word to send to attached terminal
+ */
+static uint32_t do_host_word(struct host_session *sess)
+{
+	uint32_t now = word_stamp();
+	unsigned int i;
+
+	++stats.slots;
+	hist_record(&stats.ring_fill, host_word_count(sess));
+	for (i = 0; i < HOST_WORDS_PER_SLOT; ++i) {
+		uint32_t word;
+		bool local;
+
+		if (!host_word_count(sess))
+			break;
+		word = host_word_step(sess, now, &local);
+		if (!local) {
+			if (is_plain_nop(word))
+				++stats.slots_filler;
+			return word;
+		}
+		++stats.slots_saved;
+	}
+	++stats.slots_filler;
+	return 04000003;
+}
+
+#if NO_TERMINAL
+struct keys {
+	uint16_t delay;		/* Delay in 1/60th second intervals */
+	uint16_t key;		/* Key to send */
+};
+
+const struct keys keys[] = {
+	{ 5, KEY_TURNON },
 	{ 600, KEY_NEXT },
 	{ 600, LC_KEY('r') },
 	{ 20, LC_KEY('u') },
@@ -799,8 +2284,12 @@ const uint16_t num_keys = ARRAY_SIZE(keys);
 /* send_word() - Send word to terminal
  * @sess: Pointer to host_session
  * @word: Word to send to terminal
+ *
+ * An SPI error other than an interrupted call fails the SPI subsystem.
+ *
+ * Returns 0 on success, -1 on error
  */
-static void send_word(struct host_session *sess, uint32_t word)
+static int send_word(struct host_session *sess, uint32_t word)
 {
 	uint8_t bytes[sizeof(sess->spi_buf)];
 	struct spi_ioc_transfer spi_xfer = {
@@ -822,9 +2311,16 @@ static void send_word(struct host_session *sess, uint32_t word)
 		bytes[i] = 0;
 	rc = ioctl(sess->spi_fd, SPI_IOC_MESSAGE(1), &spi_xfer);
 	if (rc < 0) {
+		int err = errno;
+
+		++stats.spi_errors;
 		fprintf(stderr, "%s: write error: %m\n", __func__);
-		return;
+		if (err != EINTR && err != EAGAIN)
+			subsys_failed(&sess->spi);
+		return -1;
 	}
+	obs_put(OBS_WORD, word >> 11);
+	return 0;
 }
 
 #if !NO_TERMINAL
@@ -841,10 +2337,25 @@ static uint32_t fls(uint32_t w)
 	return ffs(prev);
 }
 
+/* abort_all_output() - Discard host output after STOP
+ * @sess: Pointer to host_session
+ *
+ * Empties the ring and starts discarding abortable words as they are
+ * received, since the host will still send whatever it had queued.
+ * Those are in the mode of the last LDM queued, which may never have
+ * been sent.
+ */
 static void abort_all_output(struct host_session *sess)
 {
-	sess->inwd_out = sess->inwd_in;
-	sess->erase_abort_count = 0;
+	ring_flush(&sess->inwd);
+	sess->delay_skip = 0;
+	sess->clear_valid = false;
+	sess->status_valid = false;
+	sess->last_ldm = 0;
+	sess->stop_abort = true;
+	sess->stop_mode = sess->queued_mode;
+	sess->stop_end = mono_ns() + STOP_ABORT_NS;
+	flow_update(sess, false);
 }
 
 static void process_spi_byte(struct host_session *sess, uint8_t byte)
@@ -898,6 +2409,393 @@ static void process_spi_input(struct host_session *sess)
 }
 #endif /* ! NO_TERMINAL */
 
+/* word_tick() - Handle one terminal word time
+ * @sess: Pointer to host_session
+ *
+ * Sends the next word to the terminal and processes the keyset
+ * bits that came back with it. A word that fails to send is held and
+ * sent first once the SPI device works again.
+ */
+static void word_tick(struct host_session *sess)
+{
+	if (sess->spi_fd < 0)
+		return;		/* Words wait in the ring for the SPI device */
+	if (!sess->word_held)
+		sess->held_word = do_host_word(sess);
+	if (send_word(sess, sess->held_word) < 0) {
+		sess->word_held = true;	/* Sent first once SPI works */
+		return;
+	}
+	sess->word_held = false;
+#if NO_TERMINAL
+	if (/*sess->lde_count >= LDE_WAIT &&*/ sess->next_key < num_keys &&
+	    --sess->next_time == 0) {
+		send_key(sess, keys[sess->next_key].key);
+		++sess->next_key;
+		if (sess->next_key < num_keys)
+			sess->next_time = keys[sess->next_key].delay;
+		else
+			fprintf(stderr, "done sending keys\n");
+	}
+#else
+	process_spi_input(sess);
+#endif /* NO_TERMINAL */
+}
+
+/* audio_clock_set() - Publish a new audio position
+ * @c: Pointer to audio_clock
+ * @played: Frames played by the card
+ * @stamp: CLOCK_MONOTONIC time in ns when @played was sampled
+ */
+static void audio_clock_set(struct audio_clock *c, uint64_t played,
+			    uint64_t stamp)
+{
+	uint32_t seq = atomic_load_explicit(&c->seq, memory_order_relaxed);
+
+	atomic_store_explicit(&c->seq, seq + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	atomic_store_explicit(&c->played, played, memory_order_relaxed);
+	atomic_store_explicit(&c->stamp, stamp, memory_order_relaxed);
+	atomic_store_explicit(&c->seq, seq + 2, memory_order_release);
+}
+
+/* audio_clock_get() - Read the audio position
+ * @c: Pointer to audio_clock
+ * @played: Pointer to receive frames played
+ * @stamp: Pointer to receive time @played was sampled
+ */
+static void audio_clock_get(struct audio_clock *c, uint64_t *played,
+			    uint64_t *stamp)
+{
+	uint32_t seq;
+
+	do {
+		seq = atomic_load_explicit(&c->seq, memory_order_acquire);
+		*played = atomic_load_explicit(&c->played,
+					       memory_order_relaxed);
+		*stamp = atomic_load_explicit(&c->stamp, memory_order_relaxed);
+		atomic_thread_fence(memory_order_acquire);
+	} while ((seq & 1) ||
+		 seq != atomic_load_explicit(&c->seq, memory_order_relaxed));
+}
+
+/* audio_clock_update() - Sample the PCM position after a write
+ * @c: Pointer to audio_clock
+ * @g: Pointer to gsw_state that has been writing the PCM
+ *
+ * Frames played is frames written less the frames still queued.
+ * Must be called by the thread that owns the PCM.
+ */
+static void audio_clock_update(struct audio_clock *c, struct gsw_state *g)
+{
+	snd_pcm_sframes_t delay;
+
+	if (snd_pcm_delay(snd_ph, &delay) < 0 || delay < 0 ||
+	    (uint64_t)delay > g->written)
+		return;
+	audio_clock_set(c, g->written - delay, mono_ns());
+}
+
+/* jitter_record() - Count a clock error in the jitter histogram
+ * @pll: Pointer to clock_pll
+ * @err: Error in ns
+ */
+static void jitter_record(struct clock_pll *pll, double err)
+{
+	uint64_t us = (err < 0 ? -err : err) / 1000;
+	unsigned int bin = 0;
+
+	while (us && bin < JITTER_BINS - 1) {
+		us >>= 1;
+		++bin;
+	}
+	++pll->jitter[bin];
+}
+
+/* pll_sample() - Feed one audio clock sample to the drift PLL
+ * @pll: Pointer to clock_pll
+ * @played: Frames played
+ * @stamp: CLOCK_MONOTONIC time in ns when @played was sampled
+ *
+ * The offset between elapsed monotonic and elapsed audio time is
+ * predicted from the filtered offset and slope, and the error between
+ * prediction and sample pulls both along, a second order loop. The
+ * phase error is the period jitter.
+ */
+static void pll_sample(struct clock_pll *pll, uint64_t played, uint64_t stamp)
+{
+	uint64_t audio = played * NSEC_PER_SEC / SND_RATE;
+	double dt;
+	double pred;
+	double err;
+
+	if (pll->locked && stamp <= pll->last_mono)
+		return;
+	if (!pll->locked) {
+		pll->ref_mono = stamp;
+		pll->ref_audio = audio;
+		pll->last_mono = stamp;
+		pll->offset = 0;
+		pll->samples = 0;
+		pll->locked = true;
+		return;
+	}
+
+	dt = stamp - pll->last_mono;
+	pred = pll->offset + pll->slope * dt;
+	err = ((double)(stamp - pll->ref_mono) -
+	       (double)(audio - pll->ref_audio)) - pred;
+	pll->last_mono = stamp;
+	if (err > PLL_MAX_ERR || err < -PLL_MAX_ERR) {
+		++pll->relocks;
+		pll->locked = false;
+		return;
+	}
+
+	jitter_record(pll, err);
+	pll->offset = pred + PLL_KP * err;
+	pll->slope += PLL_KI * err / dt;
+	++pll->samples;
+}
+
+/* pll_ppm() - Return the audio clock error in parts per million
+ * @pll: Pointer to clock_pll
+ *
+ * Positive when the card clock runs fast, so words timed by the audio
+ * clock go out faster than 60 per second of CLOCK_MONOTONIC.
+ */
+static double pll_ppm(const struct clock_pll *pll)
+{
+	return -pll->slope * 1e6;
+}
+
+/* clock_track() - Feed a new audio clock sample, if any, to the PLL
+ * @sess: Pointer to host_session
+ */
+static void clock_track(struct host_session *sess)
+{
+	uint64_t played;
+	uint64_t stamp;
+
+	audio_clock_get(&sess->aclock, &played, &stamp);
+	if (!stamp || stamp == sess->last_stamp)
+		return;
+	sess->last_stamp = stamp;
+	pll_sample(&sess->pll, played, stamp);
+}
+
+/* word_sched_run() - Run all terminal word times that are due
+ * @sess: Pointer to host_session
+ *
+ * A word is due every FRAMES_PER_WORD frames of audio played. Between
+ * samples of the audio position, the position is extrapolated from
+ * CLOCK_MONOTONIC, for at most one period. The word timer is set for
+ * the next word, so words are spread evenly whatever the period size.
+ * After a stall of more than WORD_MAX_LAG the missed word times are
+ * dropped rather than sent in a burst. While the position is not
+ * updated the timer is set a word time ahead, so the protocol thread
+ * does not spin, and after AUDIO_STALL_PERIODS the PCM is failed so
+ * the supervisor falls back to the timer clock.
+ */
+static void word_sched_run(struct host_session *sess)
+{
+	bool capped = false;
+	uint64_t played;
+	uint64_t stamp;
+	uint64_t now;
+	uint64_t est;
+
+	clock_track(sess);
+	audio_clock_get(&sess->aclock, &played, &stamp);
+	if (!stamp)
+		return;
+
+	now = mono_ns();
+	if (now > stamp + AUDIO_STALL_PERIODS * snd_period_frames *
+	    NSEC_PER_SEC / SND_RATE) {
+		fprintf(stderr, "Audio clock stalled\n");
+		subsys_failed(&sess->pcm);
+		return;
+	}
+	est = played;
+	if (now > stamp) {
+		uint64_t ahead = (now - stamp) * SND_RATE / NSEC_PER_SEC;
+
+		if (ahead > snd_period_frames) {
+			ahead = snd_period_frames;
+			capped = true;
+		}
+		est += ahead;
+	}
+
+	if (!sess->words_started) {
+		sess->next_word = est;
+		sess->words_started = true;
+	}
+	if (est > sess->next_word + WORD_MAX_LAG) {
+		stats.words_skipped += (est - sess->next_word) / FRAMES_PER_WORD;
+		sess->next_word = est;
+	}
+	while (sess->next_word <= est) {
+		word_tick(sess);
+		sess->next_word += FRAMES_PER_WORD;
+	}
+
+	if (capped)
+		arm_timer(sess->word_timer_fd, now + FRAMES_PER_WORD *
+			  NSEC_PER_SEC / SND_RATE);
+	else
+		arm_timer(sess->word_timer_fd, stamp + (sess->next_word -
+			  played) * NSEC_PER_SEC / SND_RATE);
+}
+
+/* timer_sched_run() - Run word times due by CLOCK_MONOTONIC
+ * @sess: Pointer to host_session
+ *
+ * Used when there is no audio clock, or when the words are disciplined
+ * to CLOCK_MONOTONIC (which NTP keeps in step with wall time) rather
+ * than to the audio clock. Each deadline is computed from the start of
+ * the clock rather than from the last expiry, so timer latency does not
+ * accumulate and the rate stays at exactly 60 Hz. Without audio, the
+ * jitter histogram counts how late the timer wakes.
+ */
+static void timer_sched_run(struct host_session *sess)
+{
+	uint64_t now = mono_ns();
+	uint64_t frames;
+
+	if (snd_ph)
+		clock_track(sess);
+	if (now < sess->clock_base)
+		now = sess->clock_base;
+	frames = (now - sess->clock_base) * SND_RATE / NSEC_PER_SEC;
+
+	if (!sess->words_started) {
+		sess->next_word = frames;
+		sess->words_started = true;
+	}
+	if (frames > sess->next_word + WORD_MAX_LAG) {
+		stats.words_skipped += (frames - sess->next_word) /
+				       FRAMES_PER_WORD;
+		sess->next_word = frames - frames % FRAMES_PER_WORD;
+	}
+	if (!snd_ph && sess->next_word <= frames)
+		jitter_record(&sess->pll, now - sess->clock_base -
+			      sess->next_word * NSEC_PER_SEC / SND_RATE);
+	while (sess->next_word <= frames) {
+		word_tick(sess);
+		sess->next_word += FRAMES_PER_WORD;
+	}
+
+	arm_timer(sess->word_timer_fd, sess->clock_base +
+		  sess->next_word * NSEC_PER_SEC / SND_RATE);
+}
+
+/* word_timer_poll() - Handle the word timer
+ * @data: Pointer to host_session
+ * @pfd: Poll state for the timer
+ */
+static void word_timer_poll(void *data, struct pollfd *pfd)
+{
+	struct host_session *sess = data;
+
+	if (read_timer(pfd->fd))
+		sess->clock->run(sess);
+}
+
+/* thread_ns() - Return CPU time used by the calling thread in ns
+ */
+static uint64_t thread_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+/* synth_account() - Count the CPU time used to synthesize a period
+ * @ns: Thread CPU time in ns
+ */
+static void synth_account(uint64_t ns)
+{
+	stat_add(&stats.synth_ns, ns);
+	stat_add(&stats.synth_periods, 1);
+	if (ns > atomic_load_explicit(&stats.synth_max_ns, memory_order_relaxed))
+		atomic_store_explicit(&stats.synth_max_ns, ns,
+				      memory_order_relaxed);
+}
+
+/* pcm_count_error() - Count a PCM write error in stats
+ * @rc: Negative ALSA error
+ */
+static void pcm_count_error(snd_pcm_sframes_t rc)
+{
+	stat_add(rc == -EPIPE ? &stats.xruns : &stats.pcm_errors, 1);
+}
+
+/* pcm_write_period() - Synthesize one period of audio into the PCM
+ * @g: Pointer to gsw_state
+ *
+ * With mmap access the samples are written straight into the PCM
+ * buffer, otherwise they go through snd_pcm_writei. The caller must
+ * know that a period of space is available.
+ *
+ * Returns frames written or a negative ALSA error
+ */
+static snd_pcm_sframes_t pcm_write_period(struct gsw_state *g)
+{
+	snd_pcm_uframes_t remain = snd_period_frames;
+	snd_pcm_sframes_t rc;
+	uint64_t start;
+	uint64_t cpu = 0;
+
+	if (!snd_mmap) {
+		start = thread_ns();
+		synth_block(&g->voices, g->samples, snd_channels, g->acc,
+			    snd_period_frames);
+		synth_account(thread_ns() - start);
+		rc = snd_pcm_writei(snd_ph, g->samples, snd_period_frames);
+		if (rc > 0)
+			g->written += rc;
+		return rc;
+	}
+
+	rc = snd_pcm_avail_update(snd_ph);
+	if (rc < 0)
+		return rc;
+	while (remain) {
+		const snd_pcm_channel_area_t *areas;
+		snd_pcm_uframes_t offset;
+		snd_pcm_uframes_t frames = remain;
+		int16_t *out;
+
+		rc = snd_pcm_mmap_begin(snd_ph, &areas, &offset, &frames);
+		if (rc < 0)
+			return rc;
+		if (!frames)
+			break;
+		out = (int16_t *)((char *)areas[0].addr + areas[0].first / 8 +
+				  offset * (areas[0].step / 8));
+		start = thread_ns();
+		synth_block(&g->voices, out, snd_channels, g->acc, frames);
+		cpu += thread_ns() - start;
+		rc = snd_pcm_mmap_commit(snd_ph, offset, frames);
+		if (rc < 0)
+			return rc;
+		if ((snd_pcm_uframes_t)rc != frames)
+			return -EPIPE;
+		g->written += frames;
+		remain -= frames;
+	}
+	synth_account(cpu);
+	if (snd_pcm_state(snd_ph) == SND_PCM_STATE_PREPARED) {
+		rc = snd_pcm_start(snd_ph);
+		if (rc < 0)
+			return rc;
+	}
+	return snd_period_frames - remain;
+}
+
 #if POLL
 static void gsw_poll(void *p, struct pollfd *pfd)
 {
@@ -913,53 +2811,29 @@ static void gsw_poll(void *p, struct pollfd *pfd)
 	}
 	if (event & POLLERR) {
 		fprintf(stderr, "%s: error set\n", __func__);
+		pcm_count_error(-EPIPE);
 		rc = snd_pcm_prepare(snd_ph);
 		if (rc < 0) {
 			fprintf(stderr,
 				"%s: Can't recover, prepare failed %m\n",
 				__func__);
-			exit(1);
+			subsys_failed(&sess->pcm);
+			return;
 		}
 	}
 
 	if (event & POLLOUT) {
-		int i;
-		int voice;
-		uint32_t out_word;
-
-		rc = snd_pcm_writei(snd_ph, sess->samples,
-				    FRAMES_PER_PERIOD);
+		rc = pcm_write_period(&sess->gsw);
 		if (rc < 0) {
 			fprintf(stderr, "%s: error on snd write, rc=%d\n",
 				__func__, rc);
+			pcm_count_error(rc);
+			if (snd_pcm_recover(snd_ph, rc, 1) < 0)
+				subsys_failed(&sess->pcm);
 			return;
 		}
-		out_word = do_host_word(sess);
-		send_word(sess, out_word);
-		for (i = 0; i < (int)ARRAY_SIZE(sess->samples); ++i) {
-			uint32_t sample = 0;
-			struct voice *v = &sess->voices[0];
-
-			for (voice = 0; voice < VOICES; ++voice, ++v)
-				sample += generate(v);
-
-			sample >>= NVSHIFT;
-			sess->samples[i] = sample;
-			sess->samples[++i] = sample;
-		}
-#if NO_TERMINAL
-		if (/*sess->lde_count >= LDE_WAIT &&*/ sess->next_key < num_keys &&
-		    --sess->next_time == 0) {
-			send_key(sess, keys[sess->next_key].key);
-			++sess->next_key;
-			if (sess->next_key < num_keys)
-				sess->next_time = keys[sess->next_key].delay;
-			else
-				fprintf(stderr, "done sending keys\n");
-		}
-#else
-		process_spi_input(sess);
-#endif /* NO_TERMINAL */
+		audio_clock_update(&sess->aclock, &sess->gsw);
+		sess->clock->run(sess);
 	}
 }
 
@@ -973,49 +2847,171 @@ static void gsw_callback(snd_async_handler_t *ah)
 	int rc;
 
 	avail = snd_pcm_avail_update(ph);
-	while (avail >= FRAMES_PER_PERIOD) {
-		int i;
-		int voice;
-
-		rc = snd_pcm_writei(snd_ph, sess->samples,
-				    FRAMES_PER_PERIOD);
+	while (avail >= (snd_pcm_sframes_t)snd_period_frames) {
+		rc = pcm_write_period(&sess->gsw);
 		if (rc < 0) {
 			fprintf(stderr, "%s: error on snd write, rc=%d\n",
 				__func__, rc);
+			pcm_count_error(rc);
 			return;
 		}
-		send_word(sess, do_host_word(sess));
-
-		for (i = 0; i < (int)ARRAY_SIZE(sess->samples); ++i) {
-			uint32_t sample = 0;
-			struct voice *v = &sess->voices[0];
+		audio_clock_update(&sess->aclock, &sess->gsw);
+		sess->clock->run(sess);
 
-			for (voice = 0; voice < VOICES; ++voice, ++v)
-				sample += generate(v);
-
-			sample >>= NVSHIFT;
-			sess->samples[i] = sample;
-			sess->samples[++i] = sample;
-		}
+		avail = snd_pcm_avail_update(ph);
+	}
+}
+#endif /* POLL */
 
-#if NO_TERMINAL
-		if (/*sess->lde_count >= LDE_WAIT &&*/ sess->next_key < num_keys &&
-		    --sess->next_time == 0) {
-			send_key(sess, keys[sess->next_key].key);
-			++sess->next_key;
-			if (sess->next_key < num_keys)
-				sess->next_time = keys[sess->next_key].delay;
-			else
-				fprintf(stderr, "done sending keys\n");
+/* audio_thread() - Real-time audio synthesis thread
+ * @p: Pointer to host_session
+ *
+ * Owns the PCM handle and the GSW synthesizer. Queued GSW commands are
+ * applied, then a period is synthesized and written, waiting for space
+ * in the PCM buffer. The audio position is then published and the
+ * protocol thread woken to run any word times that are due.
+ *
+ * Runs until audio_stop is set. If the PCM cannot be recovered, or
+ * AUDIO_WAIT_TIMEOUTS waits in a row time out, the thread sets
+ * audio_failed and wakes the protocol thread to reopen it.
+ */
+static void *audio_thread(void *p)
+{
+	struct host_session *sess = p;
+	uint32_t words[GSW_Q_WORDS];
+	static const uint64_t one = 1;
+	unsigned int timeouts = 0;
+
+	while (!atomic_load(&sess->audio_stop) &&
+	       !atomic_load(&sess->audio_failed)) {
+		snd_pcm_sframes_t rc;
+		uint32_t n;
+		uint32_t i;
+
+		n = ring_get_batch(&sess->gsw_q, words, ARRAY_SIZE(words));
+		for (i = 0; i < n; ++i)
+			gsw_apply(&sess->gsw, words[i]);
+
+		rc = 0;
+		if (snd_mmap) {
+			rc = snd_pcm_wait(snd_ph, 1000);
+			if (rc == 0 && ++timeouts < AUDIO_WAIT_TIMEOUTS)
+				continue;
+			if (rc == 0) {
+				fprintf(stderr, "%s: PCM wait timed out\n",
+					__func__);
+				rc = -ETIMEDOUT;	/* Not recoverable */
+			}
+			timeouts = 0;
 		}
-#else
-		process_spi_input(sess);
-#endif /* NO_TERMINAL */
+		if (rc >= 0)
+			rc = pcm_write_period(&sess->gsw);
+		if (rc < 0) {
+			pcm_count_error(rc);
+			rc = snd_pcm_recover(snd_ph, rc, 1);
+			if (rc >= 0)
+				continue;
+			fprintf(stderr, "%s: Can't recover, rc=%ld\n",
+				__func__, rc);
+			atomic_store(&sess->audio_failed, true);
+		} else {
+			audio_clock_update(&sess->aclock, &sess->gsw);
+		}
+		if (write(sess->tick_fd, &one, sizeof(one)) != sizeof(one))
+			fprintf(stderr, "%s: tick write failed: %m\n", __func__);
+	}
+	return NULL;
+}
 
-		avail = snd_pcm_avail_update(ph);
+/* tick_poll() - Run word times after the audio thread wrote a period
+ * @data: Pointer to host_session
+ * @pfd: Poll state for the tick eventfd
+ */
+static void tick_poll(void *data, struct pollfd *pfd)
+{
+	struct host_session *sess = data;
+	uint64_t ticks;
+
+	if (read(pfd->fd, &ticks, sizeof(ticks)) != sizeof(ticks))
+		return;
+	if (atomic_load(&sess->audio_failed)) {
+		subsys_failed(&sess->pcm);
+		return;
 	}
+	sess->clock->run(sess);
+}
+
+/* start_audio_thread() - Start real-time audio synthesis thread
+ * @sess: Pointer to host_session
+ *
+ * Locks memory, then starts audio_thread at SCHED_FIFO priority,
+ * pinned to audio_cpu if one was given. Failure to get real-time
+ * scheduling or to lock memory is reported but not fatal.
+ *
+ * Returns 0 on success, -1 on error
+ */
+static int start_audio_thread(struct host_session *sess)
+{
+	struct sched_param param = { .sched_priority = AUDIO_RT_PRIO };
+	pthread_attr_t attr;
+	int rc;
+
+	ring_init(&sess->gsw_q, sess->gsw_qwords, ARRAY_SIZE(sess->gsw_qwords));
+	atomic_store(&sess->audio_stop, false);
+	atomic_store(&sess->audio_failed, false);
+	sess->tick_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (sess->tick_fd < 0) {
+		fprintf(stderr, "%s: eventfd failed: %m\n", __func__);
+		return -1;
+	}
+	register_fd(sess->tick_fd, tick_poll, POLLIN, sess);
+
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0)
+		fprintf(stderr, "%s: mlockall failed: %m\n", __func__);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+	pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+	pthread_attr_setschedparam(&attr, &param);
+	if (audio_cpu >= 0) {
+		cpu_set_t cpus;
+
+		CPU_ZERO(&cpus);
+		CPU_SET(audio_cpu, &cpus);
+		pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+	}
+
+	rc = pthread_create(&sess->audio_tid, &attr, audio_thread, sess);
+	if (rc == EPERM) {
+		fprintf(stderr, "%s: no real-time scheduling available\n",
+			__func__);
+		pthread_attr_setinheritsched(&attr, PTHREAD_INHERIT_SCHED);
+		rc = pthread_create(&sess->audio_tid, &attr, audio_thread,
+				    sess);
+	}
+	pthread_attr_destroy(&attr);
+	if (rc) {
+		fprintf(stderr, "%s: pthread_create failed, rc=%d\n",
+			__func__, rc);
+		return -1;
+	}
+	sess->audio_running = true;
+	return 0;
+}
+
+/* stop_audio_thread() - Stop the audio thread if it is running
+ * @sess: Pointer to host_session
+ *
+ * GSW commands still queued for the thread are discarded.
+ */
+static void stop_audio_thread(struct host_session *sess)
+{
+	if (!sess->audio_running)
+		return;
+	atomic_store(&sess->audio_stop, true);
+	pthread_join(sess->audio_tid, NULL);
+	sess->audio_running = false;
 }
-#endif /* POLL */
 
 static int open_gsw(struct host_session *sess)
 {
@@ -1029,6 +3025,7 @@ static int open_gsw(struct host_session *sess)
 	}
 
 	err = snd_pcm_open(&snd_ph, pcm_name, stream,
+			   audio_threaded ? 0 :
 #if POLL
 			   SND_PCM_NONBLOCK
 #else
@@ -1047,7 +3044,11 @@ static int open_gsw(struct host_session *sess)
 	}
 
 	err = snd_pcm_hw_params_set_access(snd_ph, snd_hw_params,
-					   SND_PCM_ACCESS_RW_INTERLEAVED);
+					   SND_PCM_ACCESS_MMAP_INTERLEAVED);
+	snd_mmap = err >= 0;
+	if (!snd_mmap)
+		err = snd_pcm_hw_params_set_access(snd_ph, snd_hw_params,
+						   SND_PCM_ACCESS_RW_INTERLEAVED);
 	if (err < 0) {
 		fprintf(stderr, "Error setting access\n");
 		return -1;
@@ -1072,15 +3073,18 @@ static int open_gsw(struct host_session *sess)
 		return -1;
 	}
 
+	snd_channels = SND_CHANNELS;
+	if (snd_pcm_hw_params_test_channels(snd_ph, snd_hw_params, 1) == 0)
+		snd_channels = 1;
 	err = snd_pcm_hw_params_set_channels(snd_ph, snd_hw_params,
-					     SND_CHANNELS);
+					     snd_channels);
 	if (err < 0) {
 		fprintf(stderr, "Error setting channels\n");
 		return -1;
 	}
 
 	err = snd_pcm_hw_params_set_periods(snd_ph, snd_hw_params,
-					    SND_PERIODS, 0);
+					    snd_periods, 0);
 	if (err < 0) {
 		fprintf(stderr, "Error setting periods\n");
 		return -1;
@@ -1100,315 +3104,2400 @@ static int open_gsw(struct host_session *sess)
 		return -1;
 	}
 
-	err = snd_pcm_hw_params_set_buffer_size(snd_ph, snd_hw_params,
-						SND_BUFFER_SIZE);
-	if (err < 0) {
-		fprintf(stderr, "Error setting buffer size, err=%d, errno=%d\n",
-			err, errno);
-		return -1;
+	err = snd_pcm_hw_params_set_buffer_size(snd_ph, snd_hw_params,
+						snd_period_frames * snd_periods);
+	if (err < 0) {
+		fprintf(stderr, "Error setting buffer size, err=%d, errno=%d\n",
+			err, errno);
+		return -1;
+	}
+
+	err = snd_pcm_hw_params(snd_ph, snd_hw_params);
+	if (err < 0) {
+		fprintf(stderr, "Error setting hw params\n");
+		return -1;
+	}
+
+	int cnt = snd_pcm_poll_descriptors_count(snd_ph);
+	if (cnt != 1) {
+		fprintf(stderr, "Bad descriptor count = %d\n", cnt);
+		return -1;
+	}
+
+	struct pollfd fds;
+
+	cnt = snd_pcm_poll_descriptors(snd_ph, &fds, 1);
+	if (cnt != 1) {
+		fprintf(stderr, "Returned descriptor error = %d\n", cnt);
+		return -1;
+	}
+
+	sess->snd_fd = fds.fd;
+
+	if (!audio_threaded) {
+#if POLL
+		register_fd(fds.fd, gsw_poll, POLLOUT | POLLERR, sess);
+#else
+		err = snd_async_add_pcm_handler(&sess->pcm_handler, snd_ph,
+						gsw_callback, sess);
+		if (err < 0) {
+			fprintf(stderr, "Failed to add handler, err=%d\n",
+				err);
+			return -1;
+		}
+#endif /* POLL */
+	}
+
+	fprintf(stderr, "PCM %s: %s access, %u channel%s, %u x %u frames\n",
+		pcm_name, snd_mmap ? "mmap" : "read/write", snd_channels,
+		snd_channels == 1 ? "" : "s", snd_periods, snd_period_frames);
+
+	for (i = 0; i < (int)snd_periods; ++i) {
+		err = pcm_write_period(&sess->gsw);
+		if (err < 0) {
+			fprintf(stderr, "%s: error on snd write of %d\n",
+				__func__, snd_period_frames);
+			return -1;
+		}
+	}
+	audio_clock_update(&sess->aclock, &sess->gsw);
+
+	if (audio_threaded)
+		return start_audio_thread(sess);
+	return 0;
+}
+
+/* Sources are tried in order; wall is only used when asked for */
+static const struct clock_source clock_sources[] = {
+	{ "audio", true, word_sched_run },
+	{ "timer", false, timer_sched_run },
+	{ "wall", true, timer_sched_run },
+};
+
+/* Source used while the PCM is down */
+static const struct clock_source *const timer_clock = &clock_sources[1];
+
+static const char *clock_name;	/* Clock source from -C, NULL for any */
+
+/* clock_use() - Switch the word clock to a new source
+ * @sess: Pointer to host_session
+ * @cs: Source to use
+ *
+ * Word times restart from the current time of the new source.
+ */
+static void clock_use(struct host_session *sess, const struct clock_source *cs)
+{
+	sess->clock = cs;
+	sess->clock_base = mono_ns();
+	sess->words_started = false;
+	fprintf(stderr, "Word clock: %s\n", cs->name);
+	cs->run(sess);
+}
+
+/* pcm_close() - Release the PCM and fall back to the timer clock
+ * @sess: Pointer to host_session
+ *
+ * Also cleans up after open_gsw failed part way.
+ */
+static void pcm_close(struct host_session *sess)
+{
+	stop_audio_thread(sess);
+	if (sess->tick_fd >= 0) {
+		unregister_fd(sess->tick_fd);
+		close(sess->tick_fd);
+		sess->tick_fd = -1;
+	}
+#if POLL
+	if (sess->snd_fd >= 0 && !audio_threaded)
+		unregister_fd(sess->snd_fd);
+#else
+	if (sess->pcm_handler) {
+		snd_async_del_handler(sess->pcm_handler);
+		sess->pcm_handler = NULL;
+	}
+#endif /* POLL */
+	sess->snd_fd = -1;
+	if (snd_ph) {
+		snd_pcm_close(snd_ph);
+		snd_ph = NULL;
+	}
+	if (snd_hw_params) {
+		snd_pcm_hw_params_free(snd_hw_params);
+		snd_hw_params = NULL;
+	}
+
+	sess->gsw.written = 0;
+	audio_clock_set(&sess->aclock, 0, 0);
+	sess->last_stamp = 0;
+	sess->pll.locked = false;
+	if (sess->clock && sess->clock->audio)
+		clock_use(sess, timer_clock);
+}
+
+/* pcm_open() - Open the PCM and return to the wanted word clock
+ * @sess: Pointer to host_session
+ *
+ * Returns 0 on success, -1 on error
+ */
+static int pcm_open(struct host_session *sess)
+{
+	if (open_gsw(sess) < 0)
+		return -1;
+	clock_use(sess, sess->clock_want);
+	return 0;
+}
+
+/* open_clock() - Start the word clock
+ * @sess: Pointer to host_session
+ *
+ * Uses the source named by -C, otherwise audio. Until the PCM opens,
+ * and whenever it fails, words are timed by the timer source and GSW
+ * audio is silent.
+ *
+ * Returns 0 on success or -1 if the source is unknown
+ */
+static int open_clock(struct host_session *sess)
+{
+	const struct clock_source *cs = &clock_sources[0];
+	unsigned int i;
+
+	if (clock_name) {
+		for (i = 0; i < ARRAY_SIZE(clock_sources); ++i)
+			if (!strcmp(clock_name, clock_sources[i].name))
+				break;
+		if (i == ARRAY_SIZE(clock_sources)) {
+			fprintf(stderr, "Unknown word clock %s\n", clock_name);
+			return -1;
+		}
+		cs = &clock_sources[i];
+	}
+
+	sess->clock_want = cs;
+	if (!cs->audio) {
+		clock_use(sess, cs);
+		return 0;
+	}
+	subsys_init(&sess->pcm, "PCM", pcm_open, pcm_close, sess);
+	if (subsys_start(&sess->pcm) < 0)
+		clock_use(sess, timer_clock);
+	return 0;
+}
+
+/* host_word - Accumulate host word
+ * @sess: Pointer to host_session
+ * @buf: Pointer to 3-byte input buffer
+ *
+ * Returns accumulated word, or -1 if @buf is not a valid frame
+ */
+static int32_t host_word(struct host_session *sess, const uint8_t *buf)
+{
+	uint32_t	w;
+
+	if ((buf[0] & 0200) || (buf[1] & 0300) != 0200 ||
+	    (buf[2] & 0300) != 0300) {
+		sess->host_state = out_of_sync;
+		return -1;
+	}
+	w = (buf[0] << 12) | ((buf[1] & 077) << 6) | (buf[2] & 077);
+	w <<= 1;
+	w |= (1 << 20) | host_word_parity(w);
+	return w;
+}
+
+/* erase_compact() - Drop queued words that a screen clear will hide
+ * @sess: Pointer to host_session
+ * @w: Screen clear about to be queued
+ *
+ * Abortable words queued since the previous screen clear, or since the
+ * word about to be sent if there is none queued, are removed and the
+ * rest moved up, tracking the mode to know what is abortable. Words
+ * before the previous clear were compacted when it was queued, so each
+ * word is looked at once. A status message queued by status_show() is
+ * not compacted, so it is drawn even if a screen clear follows before
+ * the first word time. Dropped words that were held over an SPI reopen
+ * come off delay_skip. The position of this clear is remembered for
+ * the next. Producer and consumer of inwd are both the main thread,
+ * so the queued words can be rewritten in place.
+ */
+static void erase_compact(struct host_session *sess, uint32_t w)
+{
+	struct word_ring *r = &sess->inwd;
+	uint32_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	uint32_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+	uint32_t held = sess->delay_skip;
+	uint32_t pos = tail;
+	uint32_t out;
+	uint8_t mode = sess->current_mode;
+
+	if (sess->clear_valid && sess->clear_pos - tail < head - tail) {
+		pos = sess->clear_pos;
+		mode = sess->clear_mode;
+	}
+	if (sess->status_valid && sess->status_end - tail <= head - tail &&
+	    sess->status_end - tail > pos - tail) {
+		pos = sess->status_end;
+		mode = sess->status_mode;
+	}
+	for (out = pos; pos != head; ++pos) {
+		uint32_t stamped = r->words[pos & r->mask];
+		uint32_t word = stamped & HOST_WORD_MASK;
+
+		if (is_abortable_command(mode, word)) {
+			if (pos - tail < held)
+				--sess->delay_skip;	/* Held over SPI reopen */
+#if HOST_DECODE3
+			fprintf(stderr, "A\n");
+			decode_host_word(word);
+#endif /* HOST_DECODE3 */
+			continue;
+		}
+		if (!(word & (1 << 19)) && ((word >> 16) & 7) == CMD_LDM)
+			mode = (word >> 4) & 3;
+		r->words[out++ & r->mask] = stamped;
+	}
+	r->head_cache = out;
+	atomic_store_explicit(&r->head, out, memory_order_release);
+	stats.erase_dropped += head - out;
+
+	sess->clear_pos = out;
+	sess->clear_mode = (w >> 4) & 3;
+	sess->clear_valid = true;
+}
+
+/* stop_filter() - Discard received words made useless by STOP
+ * @sess: Pointer to host_session structure
+ * @w: Host words, filtered in place
+ * @n: Number of words at @w
+ *
+ * Abortable words are dropped until a screen clear or a change of
+ * mode, or until STOP_ABORT_NS has passed in case neither comes.
+ *
+ * Returns number of words left at @w
+ */
+static uint32_t stop_filter(struct host_session *sess, uint32_t *w, uint32_t n)
+{
+	uint32_t out = 0;
+	uint32_t i;
+
+	if (mono_ns() > sess->stop_end) {
+		sess->stop_abort = false;
+		return n;
+	}
+	for (i = 0; i < n; ++i) {
+		uint32_t word = w[i];
+
+		if (!(word & (1 << 19)) && ((word >> 16) & 7) == CMD_LDM &&
+		    (is_screen_clear(word) ||
+		     ((word >> 4) & 3) != sess->stop_mode)) {
+			sess->stop_abort = false;
+			memmove(&w[out], &w[i], (n - i) * sizeof(*w));
+			return out + n - i;
+		}
+		if (is_abortable_command(sess->stop_mode, word)) {
+			++stats.stop_dropped;
+			continue;
+		}
+		w[out++] = word;
+	}
+	return out;
+}
+
+/* put_stamped() - Stamp host words with their receive time and queue them
+ * @sess: Pointer to host_session structure
+ * @w: 21-bit host words, the stamp is added in place
+ * @n: Number of words at @w
+ * @stamp: Receive stamp
+ *
+ * Returns number of words queued
+ */
+static uint32_t put_stamped(struct host_session *sess, uint32_t *w,
+			    uint32_t n, uint32_t stamp)
+{
+	uint32_t i;
+
+	for (i = 0; i < n; ++i) {
+		track_queued_mode(sess, w[i]);
+		w[i] |= stamp << WORD_STAMP_SHIFT;
+	}
+	return ring_put_batch(&sess->inwd, w, n);
+}
+
+/* put_host_words - Put host words into buffer
+ * @sess: Pointer to host_session structure
+ * @w: Host words, may be changed
+ * @n: Number of words at @w
+ */
+static void put_host_words(struct host_session *sess, uint32_t *w, uint32_t n)
+{
+	uint32_t stamp = word_stamp();
+	uint32_t start = 0;
+	uint32_t added = 0;
+	uint32_t i;
+
+	if (sess->stop_abort)
+		n = stop_filter(sess, w, n);
+	for (i = 0; i < n; ++i) {
+		if (!is_screen_clear(w[i]))
+			continue;
+		added += put_stamped(sess, &w[start], i - start, stamp);
+		erase_compact(sess, w[i]);
+		start = i;
+	}
+	added += put_stamped(sess, &w[start], n - start, stamp);
+	stats.overflows += n - added;
+	if (host_word_count(sess) > stats.ring_high)
+		stats.ring_high = host_word_count(sess);
+	if (added < n && debug_flag)
+		fprintf(stderr, "host word overflow, %u lost\n", n - added);
+}
+
+#define GPIO_MAX_PINS	GPIO_V2_LINES_MAX	/* Pins that can be set up */
+#define GPIO_MAX_CHIPS	8	/* GPIO chips the pins can be on */
+
+/* struct gpio_pin - GPIO line to drive before the SPI device is opened
+ * @chip: gpiochip device name, NULL if @line is a global GPIO number
+ * @line: Line offset on @chip, or global GPIO number as used by sysfs
+ * @value: Output value
+ */
+struct gpio_pin {
+	const char	*chip;
+	unsigned int	line;
+	uint8_t		value;
+};
+
+/* struct gpio_board - GPIO setup for a board
+ * @name: Suffix of the DMI board_name
+ * @pins: Pins to set up
+ * @n_pins: Number of @pins
+ */
+struct gpio_board {
+	const char	*name;
+	const struct gpio_pin *pins;
+	unsigned int	n_pins;
+};
+
+/* Routes SPI1 to the shield header. The sysfs scripts also set "strong"
+ * drive, the character device gives push-pull outputs which is the same.
+ */
+static const struct gpio_pin galileo_gen2_pins[] = {
+	{ NULL, 24, 0 }, { NULL, 25, 1 }, { NULL, 44, 1 },
+	{ NULL, 72, 0 }, { NULL, 42, 1 }, { NULL, 43, 1 },
+	{ NULL, 30, 0 }, { NULL, 31, 1 }, { NULL, 46, 1 },
+};
+
+static const struct gpio_pin galileo_pins[] = {
+	{ NULL, 4, 1 }, { NULL, 42, 0 }, { NULL, 43, 0 },
+	{ NULL, 54, 0 }, { NULL, 55, 0 },
+};
+
+/* Matched in order against the end of the board name */
+static const struct gpio_board gpio_boards[] = {
+	{ "GalileoGen2", galileo_gen2_pins, ARRAY_SIZE(galileo_gen2_pins) },
+	{ "Galileo", galileo_pins, ARRAY_SIZE(galileo_pins) },
+};
+
+static struct gpio_pin gpio_user[GPIO_MAX_PINS];	/* Pins from -g */
+static int gpio_user_pins = -1;	/* Pins in gpio_user, -1 for board table */
+static int gpio_fds[GPIO_MAX_PINS];	/* Line requests, held while running */
+static unsigned int gpio_n_fds;
+
+/* gpio_parse() - Parse a pin table given with -g
+ * @arg: "none", or comma separated [chip:]line=value, modified in place
+ *
+ * Returns 0 on success, -1 on error
+ */
+static int gpio_parse(char *arg)
+{
+	char *item;
+
+	gpio_user_pins = 0;
+	if (!strcmp(arg, "none"))
+		return 0;
+	while ((item = strsep(&arg, ","))) {
+		char *colon = strchr(item, ':');
+		struct gpio_pin *pin;
+		unsigned int value;
+		int n;
+
+		if (gpio_user_pins == GPIO_MAX_PINS)
+			return -1;
+		pin = &gpio_user[gpio_user_pins];
+		pin->chip = NULL;
+		if (colon) {
+			*colon = '\0';
+			pin->chip = item;
+			item = colon + 1;
+		}
+		if (sscanf(item, "%u=%u%n", &pin->line, &value, &n) != 2 ||
+		    item[n] || value > 1)
+			return -1;
+		pin->value = value;
+		++gpio_user_pins;
+	}
+	return 0;
+}
+
+/* read_sysfs() - Read a one line sysfs attribute
+ * @path: Path of attribute
+ * @buf: Buffer to receive the value without its newline
+ * @size: Size of @buf
+ *
+ * Returns 0 on success, -1 on error
+ */
+static int read_sysfs(const char *path, char *buf, size_t size)
+{
+	FILE *f;
+	char *p;
+
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+	p = fgets(buf, size, f);
+	fclose(f);
+	if (!p)
+		return -1;
+	buf[strcspn(buf, "\n")] = '\0';
+	return 0;
+}
+
+/* gpio_chip_dev() - Find the gpiochip device of a sysfs GPIO chip
+ * @chip: Directory name of the chip in /sys/class/gpio
+ * @name: Buffer of GPIO_MAX_NAME_SIZE to receive the device name
+ *
+ * The device that provides the chip holds the gpiochip device for it.
+ * Identical chips, such as the I/O expanders on the Galileo Gen2, have
+ * the same label and size, so only this link tells them apart. It fails
+ * if the device provides more than one chip.
+ *
+ * Returns 0 on success, -1 if not found or ambiguous
+ */
+static int gpio_chip_dev(const char *chip, char *name)
+{
+	char path[PATH_MAX];
+	struct dirent *ent;
+	unsigned int found = 0;
+	DIR *dir;
+
+	snprintf(path, sizeof(path), "/sys/class/gpio/%s/device", chip);
+	dir = opendir(path);
+	if (!dir)
+		return -1;
+	while ((ent = readdir(dir))) {
+		if (strncmp(ent->d_name, "gpiochip", 8) ||
+		    strlen(ent->d_name) >= GPIO_MAX_NAME_SIZE)
+			continue;
+		memcpy(name, ent->d_name, strlen(ent->d_name) + 1);
+		++found;
+	}
+	closedir(dir);
+	if (found > 1)
+		fprintf(stderr, "%s: %s has %u gpiochip devices\n", __func__,
+			chip, found);
+	return found == 1 ? 0 : -1;
+}
+
+/* gpio_lookup() - Find the chip and offset of a global GPIO number
+ * @gpio: GPIO number as used by sysfs
+ * @name: Buffer of GPIO_MAX_NAME_SIZE to receive the chip device name
+ * @offset: Pointer to receive the line offset on the chip
+ *
+ * The chip bases are only published in /sys/class/gpio, the chip with
+ * the base is then followed to its gpiochip device.
+ *
+ * Returns 0 on success, -1 if not found
+ */
+static int gpio_lookup(unsigned int gpio, char *name, unsigned int *offset)
+{
+	struct dirent *ent;
+	DIR *dir;
+	int rc = -1;
+
+	dir = opendir("/sys/class/gpio");
+	if (!dir)
+		return -1;
+	while ((ent = readdir(dir))) {
+		char path[PATH_MAX];
+		char buf[16];
+		unsigned int base;
+		unsigned int ngpio;
+
+		if (sscanf(ent->d_name, "gpiochip%u", &base) != 1)
+			continue;
+		snprintf(path, sizeof(path), "/sys/class/gpio/%s/ngpio",
+			 ent->d_name);
+		if (read_sysfs(path, buf, sizeof(buf)) < 0)
+			continue;
+		ngpio = atoi(buf);
+		if (gpio < base || gpio >= base + ngpio)
+			continue;
+		if (gpio_chip_dev(ent->d_name, name) == 0) {
+			*offset = gpio - base;
+			rc = 0;
+		}
+		break;
+	}
+	closedir(dir);
+	return rc;
+}
+
+/* gpio_request() - Request lines of a chip as outputs
+ * @fd: Open gpiochip device
+ * @offsets: Line offsets
+ * @values: Output values, bit n for @offsets[n]
+ * @n: Number of lines
+ *
+ * Returns the line request fd, or -1 with errno set
+ */
+static int gpio_request(int fd, const uint32_t *offsets, uint64_t values,
+			unsigned int n)
+{
+	struct gpio_v2_line_request req;
+
+	memset(&req, 0, sizeof(req));
+	memcpy(req.offsets, offsets, n * sizeof(*offsets));
+	snprintf(req.consumer, sizeof(req.consumer), "plato_if");
+	req.num_lines = n;
+	req.config.flags = GPIO_V2_LINE_FLAG_OUTPUT;
+	req.config.num_attrs = 1;
+	req.config.attrs[0].attr.id = GPIO_V2_LINE_ATTR_ID_OUTPUT_VALUES;
+	req.config.attrs[0].attr.values = values;
+	req.config.attrs[0].mask = n < 64 ? (1ULL << n) - 1 : ~0ULL;
+	if (ioctl(fd, GPIO_V2_GET_LINE_IOCTL, &req) < 0)
+		return -1;
+	return req.fd;
+}
+
+/* gpio_setup_chip() - Set up the pins on one chip
+ * @chip: Chip device name
+ * @offsets: Line offsets
+ * @values: Output values, bit n for @offsets[n]
+ * @n: Number of lines
+ *
+ * All lines are requested at once. If some are busy, as when an old
+ * init script still has them exported through sysfs, each line is
+ * requested alone and the busy ones are left as they are.
+ *
+ * Returns number of lines that could not be set up
+ */
+static unsigned int gpio_setup_chip(const char *chip, const uint32_t *offsets,
+				    uint64_t values, unsigned int n)
+{
+	char path[PATH_MAX];
+	unsigned int failed = 0;
+	unsigned int i;
+	int lfd;
+	int fd;
+
+	snprintf(path, sizeof(path), "/dev/%s", chip);
+	fd = open(path, O_RDWR | O_CLOEXEC);
+	if (fd < 0) {
+		fprintf(stderr, "Failed to open %s: %m\n", path);
+		return n;
+	}
+
+	lfd = gpio_request(fd, offsets, values, n);
+	if (lfd >= 0) {
+		gpio_fds[gpio_n_fds++] = lfd;
+	} else if (errno != EBUSY) {
+		fprintf(stderr, "%s: line request failed: %m\n", chip);
+		failed = n;
+	} else {
+		for (i = 0; i < n; ++i) {
+			lfd = gpio_request(fd, &offsets[i], (values >> i) & 1, 1);
+			if (lfd < 0) {
+				fprintf(stderr, "%s: line %u: %m, left as is\n",
+					chip, offsets[i]);
+				++failed;
+				continue;
+			}
+			gpio_fds[gpio_n_fds++] = lfd;
+		}
+	}
+	close(fd);
+	return failed;
+}
+
+/* gpio_setup() - Drive the GPIO lines the SPI interface needs
+ *
+ * Uses the pins from -g, otherwise the table for the DMI board name.
+ * The pins are grouped by chip and each chip's lines requested with a
+ * single ioctl. The line requests are held until plato_if exits.
+ *
+ * Returns 0 on success, -1 if any pin could not be set up
+ */
+static int gpio_setup(void)
+{
+	struct {
+		char		name[GPIO_MAX_NAME_SIZE];
+		uint32_t	offsets[GPIO_MAX_PINS];
+		uint64_t	values;
+		unsigned int	n;
+	} chips[GPIO_MAX_CHIPS];
+	const struct gpio_pin *pins = gpio_user;
+	unsigned int n_pins = gpio_user_pins;
+	unsigned int n_chips = 0;
+	unsigned int failed = 0;
+	unsigned int i;
+	unsigned int c;
+
+	if (gpio_user_pins < 0) {
+		char board[64];
+		size_t len;
+
+		if (read_sysfs("/sys/devices/virtual/dmi/id/board_name", board,
+			       sizeof(board)) < 0)
+			board[0] = '\0';
+		len = strlen(board);
+		for (i = 0; i < ARRAY_SIZE(gpio_boards); ++i) {
+			size_t nlen = strlen(gpio_boards[i].name);
+
+			if (len >= nlen &&
+			    !strcmp(board + len - nlen, gpio_boards[i].name))
+				break;
+		}
+		if (i == ARRAY_SIZE(gpio_boards)) {
+			fprintf(stderr, "Unknown board %s, GPIO not set up\n",
+				board);
+			return -1;
+		}
+		pins = gpio_boards[i].pins;
+		n_pins = gpio_boards[i].n_pins;
+		fprintf(stderr, "Setting up GPIO for %s\n", board);
+	}
+
+	for (i = 0; i < n_pins; ++i) {
+		char name[GPIO_MAX_NAME_SIZE];
+		unsigned int offset = pins[i].line;
+
+		if (pins[i].chip) {
+			snprintf(name, sizeof(name), "%s", pins[i].chip);
+		} else if (gpio_lookup(pins[i].line, name, &offset) < 0) {
+			fprintf(stderr, "GPIO %u: chip not found\n",
+				pins[i].line);
+			++failed;
+			continue;
+		}
+		for (c = 0; c < n_chips; ++c)
+			if (!strcmp(chips[c].name, name))
+				break;
+		if (c == n_chips) {
+			if (n_chips == GPIO_MAX_CHIPS) {
+				fprintf(stderr, "%s: too many GPIO chips\n",
+					name);
+				++failed;
+				continue;
+			}
+			memcpy(chips[c].name, name, sizeof(name));
+			chips[c].values = 0;
+			chips[c].n = 0;
+			++n_chips;
+		}
+		chips[c].values |= (uint64_t)pins[i].value << chips[c].n;
+		chips[c].offsets[chips[c].n++] = offset;
+	}
+
+	for (c = 0; c < n_chips; ++c)
+		failed += gpio_setup_chip(chips[c].name, chips[c].offsets,
+					  chips[c].values, chips[c].n);
+	return failed ? -1 : 0;
+}
+
+/* usage - Print command usage information
+ */
+static void usage(const char *cmd)
+{
+	fprintf(stderr, "%s: Command usage:\n", cmd);
+	fprintf(stderr,
+		"\t-A\tHost address cache file, empty for none"
+		" (default /var/lib/plato_if.addr)\n"
+		"\t-C\tWord clock: audio, timer or wall (default audio)\n"
+		"\t-c\tCPU to run audio thread on (with -t)\n"
+		"\t-D\tALSA PCM device (default hw:0,0)\n"
+		"\t-d\tEnable debugging\n"
+		"\t-F\tAudio period size in frames (default 800)\n"
+		"\t-g\tGPIO pins as [chip:]line=value,... or none"
+		" (default board table)\n"
+		"\t-h\tDisplay this help\n"
+		"\t-m\tObserver shared memory name, empty for none"
+		" (default /plato_if)\n"
+		"\t-N\tNumber of audio periods (default 2)\n"
+		"\t-O\tRemove terminal words that cannot change the display\n"
+		"\t-P\tStats socket path, empty for none"
+		" (default /run/plato_if.stats)\n"
+		"\t-p\tPort number (default 5004)\n"
+		"\t-r\tSPI rate\n"
+		"\t-S\tControl socket path, empty for none"
+		" (default /run/plato_if.ctl)\n"
+		"\t-s\tSPI device path\n"
+		"\t-t\tSynthesize audio on a real-time thread\n"
+		"\t-X\tFlow control marks xoff:xon in words"
+		" (default 2730:1365)\n");
+}
+
+/* process_arguments - Process arguments
+ * @argc: Number of arguments
+ * @argv: Pointer to an array of pointers to arguments
+ *
+ * Return 0 if success, non-zero on some error
+ */
+static int process_arguments(int argc, char *argv[])
+{
+	int ch;
+	const char *cmd = argv[0];
+
+	while ((ch = getopt(argc, argv, "A:C:c:D:dF:g:hm:N:OP:p:r:S:s:tX:")) != -1) {
+		switch (ch) {
+		case 'A':
+			cache_path = optarg;
+			break;
+		case 'C':
+			clock_name = optarg;
+			break;
+		case 'c':
+			audio_cpu = atoi(optarg);
+			break;
+		case 'D':
+			pcm_name = optarg;
+			break;
+		case 'd':
+			++debug_flag;
+			break;
+		case 'F':
+			snd_period_frames = atoi(optarg);
+			if (snd_period_frames < 1 ||
+			    snd_period_frames > SND_MAX_PERIOD) {
+				fprintf(stderr, "Period must be 1 to %d frames\n",
+					SND_MAX_PERIOD);
+				return 2;
+			}
+			break;
+		case 'g':
+			if (gpio_parse(optarg) < 0) {
+				fprintf(stderr, "Bad GPIO pins %s\n", optarg);
+				return 2;
+			}
+			break;
+		case 'h':
+			usage(cmd);
+			exit(0);
+		case 'm':
+			obs_name = optarg;
+			break;
+		case 'N':
+			snd_periods = atoi(optarg);
+			if (snd_periods < 2) {
+				fprintf(stderr, "At least 2 periods needed\n");
+				return 2;
+			}
+			break;
+		case 'O':
+			peephole = true;
+			break;
+		case 'P':
+			stats_path = optarg;
+			break;
+		case 'p':
+			port = optarg;
+			break;
+		case 'r':
+			spi_speed = atoi(optarg);
+			break;
+		case 'S':
+			ctl_path = optarg;
+			break;
+		case 's':
+			spi_dev = optarg;
+			break;
+		case 't':
+			audio_threaded = true;
+			break;
+		case 'X': {
+			unsigned int xoff;
+			unsigned int xon;
+
+			if (sscanf(optarg, "%u:%u", &xoff, &xon) != 2 ||
+			    flow_set_marks(&sess, xoff, xon) < 0) {
+				fprintf(stderr, "Bad flow control marks %s\n",
+					optarg);
+				return 2;
+			}
+			break;
+		}
+		case '?':
+		default:
+			return 2;
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	if (argc == 1)
+		host = argv[0];
+	else if (argc > 1) {
+		fprintf(stderr, "Too many arguments\n");
+		return 4;
+	}
+
+	return 0;
+}
+
+#define STATUS_WORDS	128	/* Longest status message in words */
+
+/* struct status_text - Terminal words being built for a status message
+ * @words: Words built so far
+ * @n: Number of words at @words
+ */
+struct status_text {
+	uint32_t	words[STATUS_WORDS];
+	unsigned int	n;
+};
+
+/* status_put() - Add a terminal word to a status message
+ * @ctx: Pointer to status_text
+ * @word: Terminal word
+ */
+static void status_put(void *ctx, uint32_t word)
+{
+	struct status_text *st = ctx;
+
+	if (st->n < ARRAY_SIZE(st->words))
+		st->words[st->n++] = word;
+}
+
+/* status_show() - Draw a status message on the terminal
+ * @sess: Pointer to host_session
+ * @msg: ASCII message
+ *
+ * The screen is cleared and the message is drawn at the top, through
+ * the word ring like host output. Only done while the host is not
+ * connected, and only when the message changes.
+ */
+static void status_show(struct host_session *sess, const char *msg)
+{
+	struct status_text st = { .n = 0 };
+	struct plato_text t = { .put = status_put, .ctx = &st, .mem = -1 };
+
+	if (sess->conn == HOST_UP || msg == sess->status)
+		return;
+	sess->status = msg;
+	fprintf(stderr, "%s\n", msg);
+
+	st.words[st.n++] = make_word((CMD_LDM << 16) | (033 << 1));
+	text_tb(&t, 077);
+	text_tb(&t, 014);		/* Home */
+	text_ascii(&t, (const uint8_t *)msg);
+	text_tb(&t, 077);
+	text_tb(&t, 015);		/* Carriage return */
+	while (t.bit_count)
+		text_tb(&t, 077);
+	put_host_words(sess, st.words, st.n);
+	sess->status_end = atomic_load_explicit(&sess->inwd.head,
+						memory_order_relaxed);
+	sess->status_mode = sess->queued_mode;
+	sess->status_valid = true;
+}
+
+/* host_status() - Show what the host connection is waiting for
+ * @sess: Pointer to host_session
+ */
+static void host_status(struct host_session *sess)
+{
+	if (!sess->net_ready)
+		status_show(sess, "Waiting for network...");
+	else if (sess->was_up)
+		status_show(sess, "Host connection lost - reconnecting...");
+	else
+		status_show(sess, "Connecting to host...");
+}
+
+/* host_retry() - Wait before trying to connect to the host again
+ * @sess: Pointer to host_session
+ *
+ * The delay doubles with each failure up to HOST_BACKOFF_MAX_MS.
+ */
+static void host_retry(struct host_session *sess)
+{
+	if (!sess->backoff_ms)
+		sess->backoff_ms = HOST_BACKOFF_MIN_MS;
+	fprintf(stderr, "Connecting to %s in %u ms\n", host, sess->backoff_ms);
+	arm_timer(sess->host_timer_fd,
+		  mono_ns() + sess->backoff_ms * 1000000ULL);
+	sess->backoff_ms *= 2;
+	if (sess->backoff_ms > HOST_BACKOFF_MAX_MS)
+		sess->backoff_ms = HOST_BACKOFF_MAX_MS;
+	sess->conn = HOST_DOWN;
+	host_status(sess);
+}
+
+/* host_lost() - Drop the host connection and arrange to reconnect
+ * @sess: Pointer to host_session
+ *
+ * Only the host side framing, key queue and flow control are reset.
+ * Words already received, the terminal, SPI and audio carry on.
+ */
+static void host_lost(struct host_session *sess)
+{
+	unregister_fd(sess->fd);
+	close(sess->fd);
+	sess->fd = -1;
+	sess->rx_len = 0;
+	sess->host_state = in_sync;
+	sess->tx_len = 0;
+	sess->tx_blocked = false;
+	sess->flow.state = FLOW_ON;
+	sess->flow.trend = 0;
+	sess->flow.last_count = host_word_count(sess);
+	host_retry(sess);
+}
+
+/* host_closed() - Handle the host closing the connection
+ * @sess: Pointer to host_session
+ */
+static void host_closed(struct host_session *sess)
+{
+	fprintf(stderr, "Host closed connection\n");
+	host_lost(sess);
+}
+
+/* host_frame() - Decode all complete host words in the receive buffer
+ * @sess: Pointer to host_session
+ *
+ * Words are framed as three bytes with the high bits 0, 10 and 11.
+ * When a frame fails that check, the buffer is scanned a byte at a
+ * time for the next valid frame. Any partial frame left at the end is
+ * moved to the start of the buffer for the next receive. The decoded
+ * words are queued in one batch.
+ */
+static void host_frame(struct host_session *sess)
+{
+	uint32_t words[HOST_RX_BUF / HOST_FRAME_SIZE];
+	uint8_t *buf = sess->rx_buf;
+	unsigned int len = sess->rx_len;
+	unsigned int pos = 0;
+	unsigned int n = 0;
+
+	while (len - pos >= HOST_FRAME_SIZE) {
+		enum host_states prev_state = sess->host_state;
+		int32_t	w = host_word(sess, &buf[pos]);
+
+		if (w < 0) {
+			if (prev_state == in_sync)
+				++stats.resync_count;
+			++stats.resync_bytes;
+			++pos;
+			continue;
+		}
+		sess->host_state = in_sync;
+		pos += HOST_FRAME_SIZE;
+
+#if HOST_DECODE1
+		decode_host_word(w);
+#endif /* HOST_DECODE1 */
+		words[n++] = w;
+	}
+
+	sess->rx_len = len - pos;
+	if (sess->rx_len && pos)
+		memmove(buf, &buf[pos], sess->rx_len);
+
+	if (!n)
+		return;
+	put_host_words(sess, words, n);
+	flow_update(sess, true);
+}
+
+static void host_poll(void *data, struct pollfd *pfd)
+{
+	struct host_session *sess = data;
+	unsigned short revents = pfd->revents;
+
+	if (revents & POLLERR) {
+		int err = 0;
+		socklen_t len = sizeof(err);
+
+		getsockopt(sess->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+		fprintf(stderr, "Host connection error, errno=%d\n", err);
+		host_lost(sess);
+		return;
+	}
+	if (revents & POLLOUT) {
+		host_flush(sess);
+		revents &= ~POLLOUT;
+		if (!revents)
+			return;
+	}
+	if (revents & POLLIN) {
+		ssize_t len;
+
+		len = recv(sess->fd, &sess->rx_buf[sess->rx_len],
+			   sizeof(sess->rx_buf) - sess->rx_len, MSG_NOSIGNAL);
+		if (len == 0) {
+			host_closed(sess);
+			return;
+		}
+		if (len < 0) {
+			int err = errno;
+
+			if (err == EAGAIN || err == EINTR)
+				return;
+			fprintf(stderr, "Error on recv, err=%d\n", err);
+			host_lost(sess);
+			return;
+		}
+		sess->rx_len += len;
+		host_frame(sess);
+	} else if (revents & POLLHUP) {
+		host_closed(sess);
+	} else {
+		fprintf(stderr, "revents=%04x\n", revents);
+	}
+}
+
+/* host_addr_add() - Add an address to try
+ * @sess: Pointer to host_session
+ * @sa: Socket address
+ * @len: Length of @sa
+ */
+static void host_addr_add(struct host_session *sess, const struct sockaddr *sa,
+			  socklen_t len)
+{
+	struct host_addr *ha;
+	unsigned int i;
+
+	if (sess->n_addrs >= HOST_ADDRS || len > sizeof(ha->sa))
+		return;
+	for (i = 0; i < sess->n_addrs; ++i) {
+		if (sess->addrs[i].len == len &&
+		    !memcmp(&sess->addrs[i].sa, sa, len))
+			return;
+	}
+	ha = &sess->addrs[sess->n_addrs++];
+	memcpy(&ha->sa, sa, len);
+	ha->len = len;
+}
+
+/* host_cache_load() - Add the last address that worked to the race
+ * @sess: Pointer to host_session
+ *
+ * The cache is only used if it was written for the same host and port.
+ * It lets a connect start before DNS is ready after a reboot.
+ */
+static void host_cache_load(struct host_session *sess)
+{
+	struct addrinfo hints = {
+		.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV,
+		.ai_socktype = SOCK_STREAM,
+	};
+	struct addrinfo *res;
+	char name[256];
+	char serv[32];
+	char addr[INET6_ADDRSTRLEN];
+	FILE *f;
+	int n;
+
+	if (!*cache_path)
+		return;
+	f = fopen(cache_path, "r");
+	if (!f)
+		return;
+	n = fscanf(f, "%255s %31s %45s", name, serv, addr);
+	fclose(f);
+	if (n != 3 || strcmp(name, host) || strcmp(serv, port))
+		return;
+	if (getaddrinfo(addr, serv, &hints, &res))
+		return;
+	host_addr_add(sess, res->ai_addr, res->ai_addrlen);
+	freeaddrinfo(res);
+}
+
+/* host_cache_save() - Remember the address that connected
+ * @ha: Address that connected
+ */
+static void host_cache_save(const struct host_addr *ha)
+{
+	char addr[INET6_ADDRSTRLEN];
+	char tmp[PATH_MAX];
+	FILE *f;
+
+	if (!*cache_path)
+		return;
+	if (getnameinfo((const struct sockaddr *)&ha->sa, ha->len, addr,
+			sizeof(addr), NULL, 0, NI_NUMERICHOST))
+		return;
+	snprintf(tmp, sizeof(tmp), "%s.tmp", cache_path);
+	f = fopen(tmp, "w");
+	if (!f) {
+		fprintf(stderr, "Failed to write %s: %m\n", tmp);
+		return;
+	}
+	fprintf(f, "%s %s %s\n", host, port, addr);
+	if (fclose(f) || rename(tmp, cache_path))
+		fprintf(stderr, "Failed to write %s: %m\n", cache_path);
+}
+
+/* host_addrs_add() - Add looked up addresses to try
+ * @sess: Pointer to host_session
+ * @res: Result of getaddrinfo
+ *
+ * As in Happy Eyeballs (RFC 8305), the families are interleaved
+ * starting with the first one returned, so that a broken IPv6 or IPv4
+ * path only delays the connect by the race delay.
+ */
+static void host_addrs_add(struct host_session *sess, struct addrinfo *res)
+{
+	struct addrinfo *fam[2][HOST_ADDRS];
+	unsigned int n[2] = { 0, 0 };
+	unsigned int i;
+	int first;
+
+	if (!res)
+		return;
+	first = res->ai_family;
+	for (; res; res = res->ai_next) {
+		unsigned int f = res->ai_family != first;
+
+		if (n[f] < HOST_ADDRS)
+			fam[f][n[f]++] = res;
+	}
+	for (i = 0; i < n[0] || i < n[1]; ++i) {
+		if (i < n[0])
+			host_addr_add(sess, fam[0][i]->ai_addr,
+				      fam[0][i]->ai_addrlen);
+		if (i < n[1])
+			host_addr_add(sess, fam[1][i]->ai_addr,
+				      fam[1][i]->ai_addrlen);
+	}
+}
+
+/* host_race_active() - Return number of connects in progress
+ * @sess: Pointer to host_session
+ */
+static unsigned int host_race_active(struct host_session *sess)
+{
+	unsigned int n = 0;
+	unsigned int i;
+
+	for (i = 0; i < HOST_RACE; ++i)
+		n += sess->race_fd[i] >= 0;
+	return n;
+}
+
+/* host_race_close() - Abandon a connect in progress
+ * @sess: Pointer to host_session
+ * @i: Index in race_fd
+ */
+static void host_race_close(struct host_session *sess, unsigned int i)
+{
+	unregister_fd(sess->race_fd[i]);
+	close(sess->race_fd[i]);
+	sess->race_fd[i] = -1;
+}
+
+static void host_connect_poll(void *data, struct pollfd *pfd);
+
+/* host_race_next() - Start a connect to the next address
+ * @sess: Pointer to host_session
+ *
+ * Addresses that fail at once are skipped. The host timer is set for
+ * when the next address should join the race, or for the deadline.
+ */
+static void host_race_next(struct host_session *sess)
+{
+	uint64_t when;
+	unsigned int i;
+
+	for (i = 0; i < HOST_RACE && sess->race_fd[i] >= 0; ++i)
+		;
+	while (i < HOST_RACE && sess->next_addr < sess->n_addrs) {
+		struct host_addr *ha = &sess->addrs[sess->next_addr];
+		int s;
+
+		s = socket(ha->sa.ss_family, SOCK_STREAM | SOCK_NONBLOCK |
+			   SOCK_CLOEXEC, 0);
+		++sess->next_addr;
+		if (s < 0)
+			continue;
+		if (connect(s, (struct sockaddr *)&ha->sa, ha->len) < 0 &&
+		    errno != EINPROGRESS) {
+			close(s);
+			continue;
+		}
+		sess->race_fd[i] = s;
+		sess->race_addr[i] = ha - sess->addrs;
+		register_fd(s, host_connect_poll, POLLOUT, sess);
+		break;
+	}
+
+	when = sess->connect_end;
+	if (sess->next_addr < sess->n_addrs && mono_ns() + HOST_RACE_NS < when)
+		when = mono_ns() + HOST_RACE_NS;
+	arm_timer(sess->host_timer_fd, when);
+}
+
+/* host_race_check() - Give up if nothing is left to try
+ * @sess: Pointer to host_session
+ */
+static void host_race_check(struct host_session *sess)
+{
+	if (sess->resolving || host_race_active(sess) ||
+	    sess->next_addr < sess->n_addrs)
+		return;
+	fprintf(stderr, "Failed to connect to host %s\n", host);
+	host_retry(sess);
+}
+
+/* host_connect_poll() - Handle completion of a connect
+ * @data: Pointer to host_session
+ * @pfd: Poll state for the connecting socket
+ *
+ * The first connect to succeed wins and the rest are closed. A failed
+ * connect makes way for the next address at once.
+ */
+static void host_connect_poll(void *data, struct pollfd *pfd)
+{
+	struct host_session *sess = data;
+	int fd = pfd->fd;
+	int true_opt = 1;
+	int err = 0;
+	socklen_t len = sizeof(err);
+	unsigned int i;
+	unsigned int win;
+
+	for (win = 0; win < HOST_RACE && sess->race_fd[win] != fd; ++win)
+		;
+	if (win == HOST_RACE)
+		return;
+
+	getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len);
+	if (err) {
+		host_race_close(sess, win);
+		host_race_next(sess);
+		host_race_check(sess);
+		return;
+	}
+
+	unregister_fd(fd);
+	sess->fd = fd;
+	sess->race_fd[win] = -1;
+	for (i = 0; i < HOST_RACE; ++i) {
+		if (sess->race_fd[i] >= 0)
+			host_race_close(sess, i);
+	}
+	arm_timer(sess->host_timer_fd, 0);
+	host_cache_save(&sess->addrs[sess->race_addr[win]]);
+
+	setsockopt(sess->fd, SOL_SOCKET, SO_KEEPALIVE, (char *)&true_opt,
+		   sizeof(true_opt));
+	setsockopt(sess->fd, IPPROTO_TCP, TCP_NODELAY, (char *)&true_opt,
+		   sizeof(true_opt));
+	sess->conn = HOST_UP;
+	sess->status = NULL;
+	sess->backoff_ms = 0;
+	sess->was_up = true;
+	++stats.connects;
+	fprintf(stderr, "Connected to host %s\n", host);
+	register_fd(sess->fd, host_poll, sess->tx_len ? POLLIN | POLLOUT :
+			POLLIN, sess);
+	sess->tx_blocked = !!sess->tx_len;
+}
+
+/* host_resolve() - Start an asynchronous lookup of the host address
+ * @sess: Pointer to host_session
+ *
+ * Completion is signalled with SIGRTMIN, handled by host_resolved.
+ */
+static void host_resolve(struct host_session *sess)
+{
+	struct gaicb *list[] = { &sess->gai };
+	struct sigevent sev = {
+		.sigev_notify = SIGEV_SIGNAL,
+		.sigev_signo = SIGRTMIN,
+	};
+	int rc;
+
+	memset(&sess->gai, 0, sizeof(sess->gai));
+	memset(&sess->gai_hints, 0, sizeof(sess->gai_hints));
+	sess->gai_hints.ai_family = PF_UNSPEC;
+	sess->gai_hints.ai_socktype = SOCK_STREAM;
+	sess->gai.ar_name = host;
+	sess->gai.ar_service = port;
+	sess->gai.ar_request = &sess->gai_hints;
+	rc = getaddrinfo_a(GAI_NOWAIT, list, 1, &sev);
+	if (rc) {
+		fprintf(stderr, "Failed to look up host %s: %s\n", host,
+			gai_strerror(rc));
+		return;
+	}
+	sess->resolving = true;
+}
+
+/* host_resolved() - Handle completion of the host address lookup
+ * @sess: Pointer to host_session
+ *
+ * The addresses found join the race.
+ */
+static void host_resolved(struct host_session *sess)
+{
+	int rc;
+
+	if (!sess->resolving)
+		return;
+	rc = gai_error(&sess->gai);
+	if (rc == EAI_INPROGRESS)
+		return;
+	sess->resolving = false;
+	if (rc) {
+		fprintf(stderr, "Failed to get address of host %s: %s\n",
+			host, gai_strerror(rc));
+	} else {
+		if (sess->conn == HOST_CONNECTING)
+			host_addrs_add(sess, sess->gai.ar_result);
+		freeaddrinfo(sess->gai.ar_result);
+	}
+	if (sess->conn != HOST_CONNECTING)
+		return;
+	if (!host_race_active(sess))
+		host_race_next(sess);
+	host_race_check(sess);
+}
+
+/* host_connect() - Start connecting to the host
+ * @sess: Pointer to host_session
+ *
+ * A connect to the cached address starts at once, while the host name
+ * is looked up. Looked up addresses then join, one every HOST_RACE_NS.
+ */
+static void host_connect(struct host_session *sess)
+{
+	sess->conn = HOST_CONNECTING;
+	sess->connect_end = mono_ns() + HOST_CONNECT_NS;
+	sess->n_addrs = 0;
+	sess->next_addr = 0;
+	host_cache_load(sess);
+	if (!sess->resolving)
+		host_resolve(sess);
+	host_race_next(sess);
+	host_race_check(sess);
+	if (sess->conn == HOST_CONNECTING)
+		host_status(sess);
+}
+
+/* is_default_route() - Check if a route message is for a default route
+ * @nh: RTM_NEWROUTE or RTM_DELROUTE message
+ */
+static bool is_default_route(const struct nlmsghdr *nh)
+{
+	const struct rtmsg *rtm = NLMSG_DATA(nh);
+
+	return !rtm->rtm_dst_len && rtm->rtm_table == RT_TABLE_MAIN;
+}
+
+/* netlink_default_route() - Check whether there is a default route
+ *
+ * The routes are dumped on a socket of its own and the reply read here,
+ * the kernel sends it at once.
+ *
+ * Returns 1 if there is a default route, 0 if not, -1 on error
+ */
+static int netlink_default_route(void)
+{
+	struct {
+		struct nlmsghdr	nh;
+		struct rtmsg	rtm;
+	} req = {
+		.nh = {
+			.nlmsg_len = NLMSG_LENGTH(sizeof(struct rtmsg)),
+			.nlmsg_type = RTM_GETROUTE,
+			.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP,
+		},
+		.rtm = { .rtm_family = AF_UNSPEC },
+	};
+	uint32_t buf[8192 / sizeof(uint32_t)];
+	int found = 0;
+	int fd;
+
+	fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+	if (fd < 0)
+		return -1;
+	if (send(fd, &req, req.nh.nlmsg_len, 0) < 0) {
+		close(fd);
+		return -1;
+	}
+	for (;;) {
+		const struct nlmsghdr *nh;
+		int len;
+
+		len = recv(fd, buf, sizeof(buf), 0);
+		if (len <= 0) {
+			found = -1;
+			break;
+		}
+		for (nh = (const struct nlmsghdr *)buf; NLMSG_OK(nh, len);
+		     nh = NLMSG_NEXT(nh, len)) {
+			if (nh->nlmsg_type == NLMSG_DONE) {
+				close(fd);
+				return found;
+			}
+			if (nh->nlmsg_type == NLMSG_ERROR) {
+				close(fd);
+				return -1;
+			}
+			if (nh->nlmsg_type == RTM_NEWROUTE &&
+			    is_default_route(nh))
+				found = 1;
+		}
+	}
+	close(fd);
+	return found;
+}
+
+/* netlink_msg() - Handle one rtnetlink message
+ * @sess: Pointer to host_session
+ * @nh: Message
+ *
+ * A new default route or address means the network may have come up,
+ * so a waiting reconnect is started at once with the backoff reset.
+ * When a default route goes, there may be another one, such as one of
+ * each address family, so the routes are checked again.
+ */
+static void netlink_msg(struct host_session *sess, const struct nlmsghdr *nh)
+{
+	switch (nh->nlmsg_type) {
+	case RTM_NEWROUTE:
+		if (!is_default_route(nh))
+			return;
+		sess->net_ready = true;
+		break;
+	case RTM_DELROUTE:
+		if (is_default_route(nh))
+			sess->net_ready = netlink_default_route() != 0;
+		return;
+	case RTM_NEWADDR:
+		break;
+	default:
+		return;
+	}
+
+	if (sess->conn == HOST_UP)
+		return;
+	host_status(sess);
+	if (sess->conn == HOST_DOWN) {
+		sess->backoff_ms = 0;
+		arm_timer(sess->host_timer_fd, mono_ns());
+	}
+}
+
+/* netlink_poll() - Handle rtnetlink route and address events
+ * @data: Pointer to host_session
+ * @pfd: Poll state for the netlink socket
+ */
+static void netlink_poll(void *data, struct pollfd *pfd)
+{
+	struct host_session *sess = data;
+	uint32_t buf[8192 / sizeof(uint32_t)];
+	const struct nlmsghdr *nh;
+	int len;
+
+	len = recv(pfd->fd, buf, sizeof(buf), 0);
+	if (len <= 0)
+		return;
+	for (nh = (const struct nlmsghdr *)buf; NLMSG_OK(nh, len);
+	     nh = NLMSG_NEXT(nh, len))
+		netlink_msg(sess, nh);
+}
+
+/* open_netlink() - Watch for the network coming up
+ * @sess: Pointer to host_session
+ *
+ * Subscribes to route and address changes, then checks the current
+ * routes for a default route before the first connect, so the status
+ * shown is right from the start. Failure only means reconnects wait
+ * for their backoff.
+ */
+static void open_netlink(struct host_session *sess)
+{
+	struct sockaddr_nl sa = {
+		.nl_family = AF_NETLINK,
+		.nl_groups = RTMGRP_IPV4_ROUTE | RTMGRP_IPV6_ROUTE |
+			     RTMGRP_IPV4_IFADDR | RTMGRP_IPV6_IFADDR,
+	};
+	int fd;
+
+	fd = socket(AF_NETLINK, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC,
+		    NETLINK_ROUTE);
+	if (fd < 0) {
+		fprintf(stderr, "%s: socket failed: %m\n", __func__);
+		sess->net_ready = true;
+		return;
+	}
+	if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+		fprintf(stderr, "%s: netlink setup failed: %m\n", __func__);
+		close(fd);
+		sess->net_ready = true;
+		return;
+	}
+	register_fd(fd, netlink_poll, POLLIN, sess);
+	sess->net_ready = netlink_default_route() != 0;
+}
+
+/* host_timer_poll() - Handle reconnect delay and connect timeouts
+ * @data: Pointer to host_session
+ * @pfd: Poll state for the timer
+ */
+static void host_timer_poll(void *data, struct pollfd *pfd)
+{
+	struct host_session *sess = data;
+	unsigned int i;
+
+	if (!read_timer(pfd->fd))
+		return;
+	switch (sess->conn) {
+	case HOST_DOWN:
+		host_connect(sess);
+		break;
+	case HOST_CONNECTING:
+		if (mono_ns() < sess->connect_end) {
+			host_race_next(sess);
+			break;
+		}
+		for (i = 0; i < HOST_RACE; ++i) {
+			if (sess->race_fd[i] >= 0)
+				host_race_close(sess, i);
+		}
+		fprintf(stderr, "Timed out connecting to host %s\n", host);
+		host_retry(sess);
+		break;
+	case HOST_UP:
+		break;
+	}
+}
+
+/* dump_clock() - Report the word clock drift and jitter
+ * @sess: Pointer to host_session
+ */
+static void dump_clock(struct host_session *sess)
+{
+	const struct clock_pll *pll = &sess->pll;
+	unsigned int i;
+
+	if (!sess->clock)
+		return;
+	fprintf(stderr, "clock: %s", sess->clock->name);
+	if (snd_ph)
+		fprintf(stderr, ", audio drift=%+.1f ppm, samples=%u, relocks=%u",
+			pll_ppm(pll), pll->samples, pll->relocks);
+	fprintf(stderr, "\njitter:");
+	for (i = 0; i < JITTER_BINS; ++i) {
+		if (!pll->jitter[i])
+			continue;
+		if (i < JITTER_BINS - 1)
+			fprintf(stderr, " <%uus=%u", 1U << i, pll->jitter[i]);
+		else
+			fprintf(stderr, " >=%uus=%u", 1U << (i - 1),
+				pll->jitter[i]);
+	}
+	fprintf(stderr, "\n");
+}
+
+/* dump_subsys() - Report health of a supervised subsystem
+ * @sub: Pointer to subsys
+ */
+static void dump_subsys(const struct subsys *sub)
+{
+	if (!sub->name)
+		return;		/* Not used */
+	fprintf(stderr, "%s: %s, failures=%u, restarts=%u\n", sub->name,
+		sub->up ? "up" : "down", sub->failures, sub->restarts);
+}
+
+/* dump_hist() - Report percentiles of a histogram
+ * @name: Name of the histogram
+ * @h: Pointer to hist
+ * @scale: Multiplier from recorded values to reported ones
+ */
+static void dump_hist(const char *name, const struct hist *h, double scale)
+{
+	if (!h->count)
+		return;
+	fprintf(stderr, "%s: n=%u, p50=%.0f, p90=%.0f, p99=%.0f, max=%.0f\n",
+		name, h->count, hist_quantile(h, 0.5) * scale,
+		hist_quantile(h, 0.9) * scale, hist_quantile(h, 0.99) * scale,
+		h->max * scale);
+}
+
+/* dump_stats() - Report session counters
+ * @sess: Pointer to host_session
+ *
+ * The fill line is in words, the word class lines give the time words
+ * waited in the ring in ms.
+ */
+static void dump_stats(struct host_session *sess)
+{
+	static const char *const conn_names[] = {
+		[HOST_DOWN] = "down",
+		[HOST_CONNECTING] = "connecting",
+		[HOST_UP] = "up",
+	};
+	unsigned int i;
+
+	fprintf(stderr, "host: %s, words=%u, high=%u, lost=%u, resyncs=%u, "
+		"skipped bytes=%u, connects=%u\n", conn_names[sess->conn],
+		host_word_count(sess), stats.ring_high, stats.overflows,
+		stats.resync_count, stats.resync_bytes, stats.connects);
+	dump_subsys(&sess->spi);
+	dump_subsys(&sess->pcm);
+	fprintf(stderr, "words: slots=%u, filler=%u, skipped=%u, "
+		"slots saved=%u, optimized=%u, erased=%u, stopped=%u, "
+		"spi errors=%u\n", stats.slots, stats.slots_filler,
+		stats.words_skipped, stats.slots_saved, stats.peep_saved,
+		stats.erase_dropped, stats.stop_dropped, stats.spi_errors);
+	fprintf(stderr, "keys: queued=%u, writes=%u, lost=%u\n",
+		stats.tx_keys, stats.tx_writes, stats.tx_drops);
+	fprintf(stderr, "flow: %s, xoff=%u, early xoff=%u, xoff retries=%u, "
+		"xon=%u, marks=%u/%u\n",
+		sess->flow.state == FLOW_ON ? "on" : "off", stats.xoffs,
+		stats.early_xoffs, stats.xoff_retries,
+		stats.xons, sess->flow.xoff_mark, sess->flow.xon_mark);
+	dump_clock(sess);
+	fprintf(stderr, "pcm: xruns=%llu, errors=%llu, synth max=%lluus\n",
+		(unsigned long long)atomic_load(&stats.xruns),
+		(unsigned long long)atomic_load(&stats.pcm_errors),
+		(unsigned long long)atomic_load(&stats.synth_max_ns) / 1000);
+	if (audio_threaded)
+		fprintf(stderr, "gsw: queue drops=%u\n", stats.gsw_q_drops);
+	dump_hist("fill", &stats.ring_fill, 1);
+	for (i = 0; i < WORD_CLASSES; ++i)
+		dump_hist(word_class_names[i], &stats.word_delay[i],
+			  (1ULL << WORD_STAMP_NS_SHIFT) / 1e6);
+}
+
+/* prom_metric() - Write one metric in Prometheus text format
+ * @f: Stream to write to
+ * @name: Metric name without the plato_ prefix
+ * @type: "counter" or "gauge"
+ * @help: Description
+ * @value: Value
+ */
+static void prom_metric(FILE *f, const char *name, const char *type,
+			const char *help, double value)
+{
+	fprintf(f, "# HELP plato_%s %s\n# TYPE plato_%s %s\nplato_%s %.17g\n",
+		name, help, name, type, name, value);
+}
+
+/* prom_subsys() - Write one health metric of the subsystems
+ * @f: Stream to write to
+ * @sess: Pointer to host_session
+ * @name: Metric name without the plato_ prefix
+ * @type: "counter" or "gauge"
+ * @help: Description
+ * @spi: Value for the SPI device
+ * @pcm: Value for the PCM device
+ *
+ * The samples of a metric must follow its HELP and TYPE as one group,
+ * so each metric is written for every subsystem in use in turn.
+ */
+static void prom_subsys(FILE *f, struct host_session *sess, const char *name,
+			const char *type, const char *help, unsigned int spi,
+			unsigned int pcm)
+{
+	fprintf(f, "# HELP plato_%s %s\n# TYPE plato_%s %s\n",
+		name, help, name, type);
+	if (sess->spi.name)
+		fprintf(f, "plato_%s{subsys=\"%s\"} %u\n", name,
+			sess->spi.name, spi);
+	if (sess->pcm.name)
+		fprintf(f, "plato_%s{subsys=\"%s\"} %u\n", name,
+			sess->pcm.name, pcm);
+}
+
+/* prom_hist() - Write a histogram as a Prometheus summary
+ * @f: Stream to write to
+ * @name: Metric name without the plato_ prefix
+ * @label: Label to add, "" for none
+ * @h: Pointer to hist
+ * @scale: Multiplier from recorded values to the metric's unit
+ */
+static void prom_hist(FILE *f, const char *name, const char *label,
+		      const struct hist *h, double scale)
+{
+	static const double quantiles[] = { 0.5, 0.9, 0.99, 1 };
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(quantiles); ++i)
+		fprintf(f, "plato_%s{%s%squantile=\"%g\"} %.17g\n", name,
+			label, *label ? "," : "", quantiles[i],
+			hist_quantile(h, quantiles[i]) * scale);
+	fprintf(f, "plato_%s_sum{%s} %.17g\nplato_%s_count{%s} %u\n",
+		name, label, h->sum * scale, name, label, h->count);
+}
+
+/* prom_stats() - Write all stats in Prometheus text format
+ * @sess: Pointer to host_session
+ * @f: Stream to write to
+ */
+static void prom_stats(struct host_session *sess, FILE *f)
+{
+	unsigned int i;
+
+	prom_metric(f, "host_up", "gauge", "Connected to the host",
+		    sess->conn == HOST_UP);
+	prom_metric(f, "host_connects_total", "counter",
+		    "Connections made to the host", stats.connects);
+	prom_metric(f, "host_resyncs_total", "counter",
+		    "Times host word framing was lost", stats.resync_count);
+	prom_metric(f, "host_resync_bytes_total", "counter",
+		    "Bytes skipped to regain host word framing",
+		    stats.resync_bytes);
+	prom_metric(f, "ring_words", "gauge", "Host words queued",
+		    host_word_count(sess));
+	prom_metric(f, "ring_high_words", "gauge",
+		    "Most host words ever queued", stats.ring_high);
+	prom_metric(f, "ring_overflow_words_total", "counter",
+		    "Host words lost to a full queue", stats.overflows);
+	prom_metric(f, "slots_total", "counter",
+		    "Terminal word times used", stats.slots);
+	prom_metric(f, "slots_filler_total", "counter",
+		    "Terminal word times that sent only a plain NOP",
+		    stats.slots_filler);
+	prom_metric(f, "slots_saved_total", "counter",
+		    "Local words that used no word time", stats.slots_saved);
+	prom_metric(f, "slots_skipped_total", "counter",
+		    "Word times dropped after a stall", stats.words_skipped);
+	prom_metric(f, "words_optimized_total", "counter",
+		    "Words removed by the optimizer", stats.peep_saved);
+	prom_metric(f, "words_erased_total", "counter",
+		    "Words dropped before a screen clear", stats.erase_dropped);
+	prom_metric(f, "words_stopped_total", "counter",
+		    "Words discarded after STOP", stats.stop_dropped);
+	prom_metric(f, "spi_errors_total", "counter",
+		    "Failed SPI transfers", stats.spi_errors);
+	prom_metric(f, "keys_total", "counter",
+		    "Keys queued to the host", stats.tx_keys);
+	prom_metric(f, "keys_dropped_total", "counter",
+		    "Keys lost to a full queue", stats.tx_drops);
+	prom_metric(f, "host_writes_total", "counter",
+		    "Writes to the host", stats.tx_writes);
+	prom_metric(f, "xoff_total", "counter",
+		    "XOFF sent on reaching the XOFF mark", stats.xoffs);
+	prom_metric(f, "xoff_early_total", "counter",
+		    "XOFF sent early because of the fill trend",
+		    stats.early_xoffs);
+	prom_metric(f, "xoff_retries_total", "counter",
+		    "XOFF sent again because the host kept sending",
+		    stats.xoff_retries);
+	prom_metric(f, "xon_total", "counter", "XON sent", stats.xons);
+	prom_metric(f, "flow_off", "gauge", "Host has been sent XOFF",
+		    sess->flow.state == FLOW_OFF);
+	prom_metric(f, "flow_xoff_mark_words", "gauge",
+		    "Queued host words at which XOFF is sent",
+		    sess->flow.xoff_mark);
+	prom_metric(f, "flow_xon_mark_words", "gauge",
+		    "Queued host words at which XON is sent",
+		    sess->flow.xon_mark);
+	fprintf(f, "# HELP plato_ring_fill_words Host words queued at each "
+		"word time\n# TYPE plato_ring_fill_words summary\n");
+	prom_hist(f, "ring_fill_words", "", &stats.ring_fill, 1);
+	fprintf(f, "# HELP plato_word_delay_seconds Time host words waited "
+		"in the queue, in steps of %.4gs\n"
+		"# TYPE plato_word_delay_seconds summary\n",
+		(1ULL << WORD_STAMP_NS_SHIFT) / 1e9);
+	for (i = 0; i < WORD_CLASSES; ++i) {
+		char label[32];
+
+		snprintf(label, sizeof(label), "class=\"%s\"",
+			 word_class_names[i]);
+		prom_hist(f, "word_delay_seconds", label,
+			  &stats.word_delay[i],
+			  (1ULL << WORD_STAMP_NS_SHIFT) / 1e9);
+	}
+	prom_metric(f, "pcm_xruns_total", "counter", "PCM underruns",
+		    atomic_load(&stats.xruns));
+	prom_metric(f, "pcm_errors_total", "counter",
+		    "PCM write errors other than underruns",
+		    atomic_load(&stats.pcm_errors));
+	prom_metric(f, "synth_periods_total", "counter",
+		    "Audio periods synthesized",
+		    atomic_load(&stats.synth_periods));
+	prom_metric(f, "synth_seconds_total", "counter",
+		    "Thread CPU time spent synthesizing audio",
+		    atomic_load(&stats.synth_ns) / 1e9);
+	prom_metric(f, "synth_max_seconds", "gauge",
+		    "Longest synthesis of one audio period",
+		    atomic_load(&stats.synth_max_ns) / 1e9);
+	prom_metric(f, "gsw_queue_drops_total", "counter",
+		    "GSW commands lost to a full audio queue",
+		    stats.gsw_q_drops);
+	prom_subsys(f, sess, "subsys_up", "gauge",
+		    "Device is open and working", sess->spi.up, sess->pcm.up);
+	prom_subsys(f, sess, "subsys_failures_total", "counter",
+		    "Times the device failed", sess->spi.failures,
+		    sess->pcm.failures);
+	prom_subsys(f, sess, "subsys_restarts_total", "counter",
+		    "Times the device was reopened", sess->spi.restarts,
+		    sess->pcm.restarts);
+}
+
+/* stats_poll() - Answer a connection to the stats socket
+ * @data: Pointer to host_session
+ * @pfd: Poll state for the listening socket
+ *
+ * The stats are written in Prometheus text format and the connection
+ * closed. All formatting is done here, none in the word path.
+ */
+static void stats_poll(void *data, struct pollfd *pfd)
+{
+	struct host_session *sess = data;
+	char *buf;
+	size_t len;
+	FILE *f;
+	int fd;
+
+	fd = accept4(pfd->fd, NULL, NULL, SOCK_CLOEXEC);
+	if (fd < 0)
+		return;
+	f = open_memstream(&buf, &len);
+	if (f) {
+		prom_stats(sess, f);
+		if (fclose(f) == 0) {
+			if (send(fd, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL) < 0)
+				fprintf(stderr, "%s: send failed: %m\n",
+					__func__);
+			free(buf);
+		}
+	}
+	close(fd);
+}
+
+/* open_stats() - Open the stats socket
+ * @sess: Pointer to host_session
+ * @path: Path to bind the stream socket to, "" for none
+ *
+ * Failure is reported but not fatal.
+ */
+static void open_stats(struct host_session *sess, const char *path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	int fd;
+
+	if (!*path)
+		return;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Stats socket path too long\n");
+		return;
 	}
+	strcpy(addr.sun_path, path);
 
-	err = snd_pcm_hw_params(snd_ph, snd_hw_params);
-	if (err < 0) {
-		fprintf(stderr, "Error setting hw params\n");
-		return -1;
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		fprintf(stderr, "%s: socket failed: %m\n", __func__);
+		return;
 	}
-
-	int cnt = snd_pcm_poll_descriptors_count(snd_ph);
-	if (cnt != 1) {
-		fprintf(stderr, "Bad descriptor count = %d\n", cnt);
-		return -1;
+	unlink(path);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    listen(fd, 4) < 0) {
+		fprintf(stderr, "Failed to bind stats socket %s: %m\n", path);
+		close(fd);
+		return;
 	}
+	register_fd(fd, stats_poll, POLLIN, sess);
+}
 
-	struct pollfd fds;
+#define UPGRADE_ENV	"PLATO_IF_STATE"	/* memfd of the old process state */
+#define UPGRADE_MAGIC	0x504c5550	/* "PLUP" */
+#define UPGRADE_VERSION	4	/* Bump when upgrade_state or words change */
+
+/* struct upgrade_state - State handed to a new binary by upgrade_exec
+ * @magic: UPGRADE_MAGIC
+ * @version: UPGRADE_VERSION of the binary that wrote the state
+ * @size: Size of the structure that was written
+ * @host_fd: Connected host socket, -1 if not connected
+ * @spi_fd: SPI device, -1 if not open
+ * @n_gpio_fds: Number of @gpio_fds
+ * @gpio_fds: GPIO line requests
+ * @n_words: Host words that follow the structure, with receive stamps
+ *
+ * Voice amplitudes are indexes to amp, ARRAY_SIZE(amp) for silent.
+ * The fields up to @n_words are kept by every version, so the fds and
+ * the words, which follow at @size, are adopted even from a binary of
+ * another version. The rest is only used when @version and @size
+ * match, otherwise XON is sent in case the old binary had stopped the
+ * host.
+ */
+struct upgrade_state {
+	uint32_t	magic;
+	uint32_t	version;
+	uint32_t	size;
+	int32_t		host_fd;
+	int32_t		spi_fd;
+	uint32_t	n_gpio_fds;
+	int32_t		gpio_fds[GPIO_MAX_PINS];
+	uint32_t	n_words;
+
+	uint8_t		host_state;
+	uint8_t		current_mode;
+	uint8_t		wc;
+	uint8_t		inhibit;
+	int32_t		pending_echo;
+	uint32_t	last_ldm;
+	uint32_t	lde_count;
+	uint32_t	held_word;
+	bool		word_held;
+	struct flow_ctl	flow;
+	bool		stop_abort;
+	uint8_t		stop_mode;
+	uint64_t	stop_end;
+#if NO_TERMINAL
+	uint16_t	next_key;
+	uint16_t	next_time;
+#else
+	uint32_t	key_bits;
+	uint16_t	key_bit_count;
+	bool		key_stop_search;
+#endif /* NO_TERMINAL */
+	uint8_t		gsw_cis;
+	uint8_t		gsw_vs;
+	uint8_t		gsw_vix;
+	uint8_t		gsw_amp[VOICES];
+	uint32_t	gsw_incr[VOICES];
+	uint32_t	gsw_phase[VOICES];
+	uint16_t	rx_len;
+	uint16_t	tx_len;
+	uint8_t		rx_buf[HOST_RX_BUF];
+	uint8_t		tx_buf[HOST_TX_BUF];
+};
 
-	cnt = snd_pcm_poll_descriptors(snd_ph, &fds, 1);
-	if (cnt != 1) {
-		fprintf(stderr, "Returned descriptor error = %d\n", cnt);
-		return -1;
-	}
+static char **self_argv;	/* Arguments to run the new binary with */
 
-	sess->snd_fd = fds.fd;
+/* upgrade_save() - Collect the session state for a new binary
+ * @sess: Pointer to host_session
+ * @st: Pointer to upgrade_state to fill in
+ */
+static void upgrade_save(struct host_session *sess, struct upgrade_state *st)
+{
+	unsigned int i;
 
-#if POLL
-	register_fd(fds.fd, gsw_poll, POLLOUT | POLLERR, sess);
+	memset(st, 0, sizeof(*st));
+	st->magic = UPGRADE_MAGIC;
+	st->version = UPGRADE_VERSION;
+	st->size = sizeof(*st);
+	st->host_fd = sess->conn == HOST_UP ? sess->fd : -1;
+	st->spi_fd = sess->spi_fd;
+	st->n_gpio_fds = gpio_n_fds;
+	memcpy(st->gpio_fds, gpio_fds, sizeof(st->gpio_fds));
+	st->n_words = ring_count(&sess->inwd);
+
+	st->host_state = sess->host_state;
+	st->current_mode = sess->current_mode;
+	st->wc = sess->wc;
+	st->inhibit = sess->inhibit;
+	st->pending_echo = sess->pending_echo;
+	st->last_ldm = sess->last_ldm;
+	st->lde_count = sess->lde_count;
+	st->held_word = sess->held_word;
+	st->word_held = sess->word_held;
+	st->flow = sess->flow;
+	st->stop_abort = sess->stop_abort;
+	st->stop_mode = sess->stop_mode;
+	st->stop_end = sess->stop_end;
+#if NO_TERMINAL
+	st->next_key = sess->next_key;
+	st->next_time = sess->next_time;
 #else
-	err = snd_async_add_pcm_handler(&sess->pcm_handler, snd_ph,
-					gsw_callback, sess);
-	if (err < 0) {
-		fprintf(stderr, "Failed to add handler, err=%d\n", err);
-		return -1;
+	st->key_bits = sess->key_bits;
+	st->key_bit_count = sess->key_bit_count;
+	st->key_stop_search = sess->key_stop_search;
+#endif /* NO_TERMINAL */
+	st->gsw_cis = sess->gsw.cis;
+	st->gsw_vs = sess->gsw.vs;
+	st->gsw_vix = sess->gsw.vix;
+	for (i = 0; i < VOICES; ++i) {
+		const struct amp *a = sess->gsw.voices.amp[i];
+
+		st->gsw_amp[i] = ARRAY_SIZE(amp);
+		if (a)
+			st->gsw_amp[i] = a - amp;
+		st->gsw_incr[i] = sess->gsw.voices.incr[i];
+		st->gsw_phase[i] = sess->gsw.voices.phase[i];
 	}
-#endif /* POLL */
+	st->rx_len = sess->rx_len;
+	memcpy(st->rx_buf, sess->rx_buf, sess->rx_len);
+	st->tx_len = sess->tx_len;
+	memcpy(st->tx_buf, sess->tx_buf, sess->tx_len);
+}
 
-	for (i = 0; i < SND_PERIODS; ++i) {
-		err = snd_pcm_writei(snd_ph, silence,
-				     FRAMES_PER_PERIOD);
-		if (err < 0) {
-			fprintf(stderr, "%s: error on snd write of %d\n",
-				__func__, FRAMES_PER_PERIOD);
-			return -1;
-		}
-	}
+/* upgrade_inherit() - Set whether the handed over fds survive exec
+ * @st: Pointer to upgrade_state holding the fds
+ * @inherit: true to clear FD_CLOEXEC, false to set it again
+ */
+static void upgrade_inherit(const struct upgrade_state *st, bool inherit)
+{
+	int flags = inherit ? 0 : FD_CLOEXEC;
+	unsigned int i;
 
-	return 0;
+	if (st->host_fd >= 0)
+		fcntl(st->host_fd, F_SETFD, flags);
+	if (st->spi_fd >= 0)
+		fcntl(st->spi_fd, F_SETFD, flags);
+	for (i = 0; i < st->n_gpio_fds; ++i)
+		fcntl(st->gpio_fds[i], F_SETFD, flags);
 }
 
-/* open_host - Open a session to the host
- * @host: Pointer to host DNS name
+/* upgrade_exec() - Replace plato_if with the binary now at its path
+ * @sess: Pointer to host_session
  *
- * Returns file descriptor or -1 if error
+ * The session state and the queued host words are written to a memfd,
+ * and the host socket, SPI device and GPIO line requests are inherited
+ * by the new binary, which resumes them in upgrade_resume. The PCM is
+ * closed first, so the voices are settled, and reopened by the new
+ * binary. If the exec fails, plato_if carries on as before.
  */
-static int open_host(const char *host)
+static void upgrade_exec(struct host_session *sess)
 {
-	int	s;
-	int	rc;
-	int	err;
-	const char	*cause = NULL;
-	struct addrinfo	hints;
-	struct addrinfo *res, *res0;
+	struct upgrade_state *st;
+	uint32_t *words;
+	char env[16];
+	bool pcm_up = sess->pcm.up;
+	uint32_t i;
+	uint32_t w;
+	int fd;
 
-	memset(&hints, 0, sizeof(hints));
-	hints.ai_family = PF_UNSPEC;
-	hints.ai_socktype = SOCK_STREAM;
-	rc = getaddrinfo(host, port, &hints, &res0);
-	if (rc < 0) {
-		fprintf(stderr, "Failed to get address of host %s\n", host);
-		return -1;
+	sess->upgrade = false;
+	if (pcm_up) {
+		sess->pcm.up = false;
+		pcm_close(sess);
+		while (audio_threaded && ring_get(&sess->gsw_q, &w))
+			gsw_apply(&sess->gsw, w);
 	}
-	s = -1;
-	err = 0;
-	for (res = res0; res; res = res->ai_next) {
-		int true_opt = 1;
 
-		s = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
-		if (s < 0) {
-			cause = "socket";
-			err = errno;
-			continue;
-		}
-		if (connect(s, res->ai_addr, res->ai_addrlen) < 0) {
-			cause = "socket";
-			err = errno;
-			close(s);
-			s = -1;
-			continue;
-		}
-		setsockopt(s, SOL_SOCKET, SO_KEEPALIVE, (char *)&true_opt,
-			   sizeof(true_opt));
-		fcntl(s, F_SETFL, O_NONBLOCK);
-		break;
+	st = malloc(sizeof(*st));
+	words = malloc(HOST_IN_WORDS * sizeof(*words));
+	fd = memfd_create("plato_if-state", 0);
+	if (!st || !words || fd < 0) {
+		fprintf(stderr, "%s: no memory for state: %m\n", __func__);
+		goto out;
 	}
-	freeaddrinfo(res0);
-	if (s < 0) {
-		fprintf(stderr, "%s() failed for host %s\n", cause, host);
-		errno = err;
-		return -1;
+	upgrade_save(sess, st);
+	for (i = 0; i < st->n_words; ++i)
+		ring_peek(&sess->inwd, i, &words[i]);
+	if (write(fd, st, sizeof(*st)) != sizeof(*st) ||
+	    write(fd, words, st->n_words * sizeof(*words)) !=
+	    (ssize_t)(st->n_words * sizeof(*words)) ||
+	    lseek(fd, 0, SEEK_SET) < 0) {
+		fprintf(stderr, "%s: state write failed: %m\n", __func__);
+		goto out;
 	}
-	return s;
+
+	upgrade_inherit(st, true);
+	snprintf(env, sizeof(env), "%d", fd);
+	setenv(UPGRADE_ENV, env, 1);
+	fprintf(stderr, "Upgrading to %s, %u words queued\n", self_argv[0],
+		st->n_words);
+	fflush(stderr);
+	execvp(self_argv[0], self_argv);
+
+	fprintf(stderr, "Upgrade to %s failed: %m\n", self_argv[0]);
+	unsetenv(UPGRADE_ENV);
+	upgrade_inherit(st, false);
+out:
+	if (fd >= 0)
+		close(fd);
+	free(words);
+	free(st);
+	if (pcm_up)
+		subsys_start(&sess->pcm);
 }
 
-/* host_word_parity - Compute host word parity
- * @w: 19-bit word to compute parity on
+/* upgrade_words() - Queue the host words handed over by the old binary
+ * @sess: Pointer to host_session
+ * @fd: State memfd
+ * @st: State as read
+ * @same: State is of this version
+ *
+ * The words follow the state as the old binary wrote it, at @st->size,
+ * so they can be taken from any version. Words from another version
+ * may carry other bits above the 21-bit word, so those are cleared and
+ * the words stamped as received now.
  *
- * Return 1 if parity was odd, 0 if it was even
+ * Returns number of words queued
  */
-static uint32_t	host_word_parity(uint32_t w)
+static uint32_t upgrade_words(struct host_session *sess, int fd,
+			      const struct upgrade_state *st, bool same)
 {
-	static const uint32_t	p32 = 0x96696996;
-	uint32_t	parity = 0;
+	uint32_t *words;
+	uint32_t n = 0;
+	uint32_t i;
+	ssize_t len;
 
-	while (w) {
-		uint8_t	bits = w & 037;		/* Extract 5 bits */
-
-		parity ^= (p32 >> bits) & 1;
-		w >>= 5;
+	if (st->n_words > HOST_IN_WORDS ||
+	    lseek(fd, st->size, SEEK_SET) != (off_t)st->size)
+		return 0;
+	words = malloc(HOST_IN_WORDS * sizeof(*words));
+	if (!words)
+		return 0;
+	len = read(fd, words, st->n_words * sizeof(*words));
+	if (len > 0)
+		n = len / sizeof(*words);
+	sess->queued_mode = sess->current_mode;
+	if (same) {
+		n = ring_put_batch(&sess->inwd, words, n);
+		for (i = 0; i < n; ++i)
+			track_queued_mode(sess, words[i] & HOST_WORD_MASK);
+	} else {
+		for (i = 0; i < n; ++i)
+			words[i] &= HOST_WORD_MASK;
+		n = put_stamped(sess, words, n, word_stamp());
 	}
-
-	return parity;
+	free(words);
+	return n;
 }
 
-/* host_word - Accumulate host word
+/* upgrade_resume() - Take over the state of the binary that exec'd us
  * @sess: Pointer to host_session
- * @buf: Pointer to 3-byte input buffer
  *
- * Returns accumulated word
+ * Must be called after open_poll and before the SPI device and host
+ * connection are opened, which are skipped for the inherited ones.
+ *
+ * Returns true if state was handed over
  */
-static int32_t host_word(struct host_session *sess, uint8_t *buf)
+static bool upgrade_resume(struct host_session *sess)
 {
-	uint32_t	w;
+	const char *env = getenv(UPGRADE_ENV);
+	struct upgrade_state *st;
+	uint32_t n;
+	uint32_t i;
+	ssize_t len;
+	int fd;
 
-	if ((buf[0] & 0200) || (buf[1] & 0300) != 0200 ||
-	    (buf[2] & 0300) != 0300) {
-		sess->host_state = out_of_sync;
-		return -1;
+	if (!env)
+		return false;
+	fd = atoi(env);
+	unsetenv(UPGRADE_ENV);
+	st = calloc(1, sizeof(*st));
+	if (!st) {
+		close(fd);
+		return false;
 	}
-	w = (buf[0] << 12) | ((buf[1] & 077) << 6) | (buf[2] & 077);
-	w <<= 1;
-	w |= (1 << 20) | host_word_parity(w);
-	return w;
+	len = read(fd, st, sizeof(*st));
+	if (len < (ssize_t)offsetof(struct upgrade_state, host_state) ||
+	    st->magic != UPGRADE_MAGIC ||
+	    st->size < offsetof(struct upgrade_state, host_state)) {
+		fprintf(stderr, "%s: no upgrade state\n", __func__);
+		close(fd);
+		free(st);
+		return false;
+	}
+	if (st->n_gpio_fds > GPIO_MAX_PINS)
+		st->n_gpio_fds = GPIO_MAX_PINS;
+
+	upgrade_inherit(st, false);
+	if (st->spi_fd >= 0)
+		sess->spi_fd = st->spi_fd;
+	for (i = 0; i < st->n_gpio_fds; ++i)
+		gpio_fds[gpio_n_fds++] = st->gpio_fds[i];
+	if (st->host_fd >= 0) {
+		sess->fd = st->host_fd;
+		sess->conn = HOST_UP;
+		sess->was_up = true;
+		register_fd(sess->fd, host_poll, POLLIN, sess);
+	}
+
+	if (st->version != UPGRADE_VERSION || st->size != sizeof(*st) ||
+	    len != sizeof(*st)) {
+		n = upgrade_words(sess, fd, st, false);
+		fprintf(stderr, "Upgrade state version %u, only fds and %u "
+			"words kept\n", st->version, n);
+		/* The old binary may have sent XOFF */
+		if (sess->conn == HOST_UP) {
+			send_key(sess, KEY_XON);
+			++stats.xons;
+		}
+		close(fd);
+		free(st);
+		return true;
+	}
+
+	sess->host_state = st->host_state;
+	sess->current_mode = st->current_mode;
+	sess->wc = st->wc;
+	sess->inhibit = st->inhibit;
+	sess->pending_echo = st->pending_echo;
+	sess->last_ldm = st->last_ldm;
+	sess->lde_count = st->lde_count;
+	sess->held_word = st->held_word;
+	sess->word_held = st->word_held;
+	sess->flow = st->flow;
+	sess->stop_abort = st->stop_abort;
+	sess->stop_mode = st->stop_mode;
+	sess->stop_end = st->stop_end;
+#if NO_TERMINAL
+	sess->next_key = st->next_key;
+	sess->next_time = st->next_time;
+#else
+	sess->key_bits = st->key_bits;
+	sess->key_bit_count = st->key_bit_count;
+	sess->key_stop_search = st->key_stop_search;
+#endif /* NO_TERMINAL */
+	sess->gsw.cis = st->gsw_cis;
+	sess->gsw.vs = st->gsw_vs;
+	sess->gsw.vix = st->gsw_vix;
+	for (i = 0; i < VOICES; ++i) {
+		if (st->gsw_amp[i] < ARRAY_SIZE(amp))
+			setamp(&sess->gsw, i, st->gsw_amp[i]);
+		sess->gsw.voices.incr[i] = st->gsw_incr[i];
+		sess->gsw.voices.phase[i] = st->gsw_phase[i];
+	}
+	if (st->rx_len <= sizeof(sess->rx_buf)) {
+		sess->rx_len = st->rx_len;
+		memcpy(sess->rx_buf, st->rx_buf, st->rx_len);
+	}
+	if (st->tx_len <= sizeof(sess->tx_buf)) {
+		sess->tx_len = st->tx_len;
+		memcpy(sess->tx_buf, st->tx_buf, st->tx_len);
+	}
+	n = upgrade_words(sess, fd, st, true);
+	fprintf(stderr, "Resumed after upgrade, %u words queued\n", n);
+	close(fd);
+	free(st);
+	return true;
 }
 
-/* put_host_word - Put host word into buffer
- * @sess: Pointer to host_session structure
- * @w: Host word
- */
-static void put_host_word(struct host_session *sess, uint32_t w)
+static void signal_poll(void *data, struct pollfd *pfd)
 {
-	uint16_t tmp_ix;
+	struct host_session *sess = data;
+	struct signalfd_siginfo si;
+	ssize_t len;
+
+	len = read(pfd->fd, &si, sizeof(si));
+	if (len != sizeof(si))
+		return;
 
-	tmp_ix = sess->inwd_in;
-	if (is_screen_clear(w))
-		++sess->erase_abort_count;
-	sess->inwds[tmp_ix++] = w;
-	if (tmp_ix == ARRAY_SIZE(sess->inwds))
-		tmp_ix = 0;
-	if (tmp_ix == sess->inwd_out) {
-		fprintf(stderr, "host word overflow\n");
+	if ((int)si.ssi_signo == SIGRTMIN) {
+		host_resolved(sess);
 		return;
 	}
-	sess->inwd_in = tmp_ix;
+	switch (si.ssi_signo) {
+	case SIGUSR1:
+		dump_stats(sess);
+		break;
+	case SIGUSR2:
+		sess->upgrade = true;
+		break;
+	}
 }
 
-/* usage - Print command usage information
+/* open_signals() - Route signals through the poll loop
+ * @sess: Pointer to host_session
+ *
+ * Returns 0 on success, -1 on error
  */
-static void usage(const char *cmd)
+static int open_signals(struct host_session *sess)
 {
-	fprintf(stderr, "%s: Command usage:\n", cmd);
-	fprintf(stderr,
-		"\t-d\tEnable debugging\n"
-		"\t-h\tDisplay this help\n"
-		"\t-p\tPort number (default 5004)\n"
-		"\t-r\tSPI rate\n"
-		"\t-s\tSPI device path\n");
+	sigset_t mask;
+	int fd;
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGUSR1);
+	sigaddset(&mask, SIGUSR2);	/* Upgrade to a new binary */
+	sigaddset(&mask, SIGRTMIN);	/* Host address lookup done */
+	if (sigprocmask(SIG_BLOCK, &mask, NULL) < 0) {
+		fprintf(stderr, "%s: sigprocmask failed: %m\n", __func__);
+		return -1;
+	}
+	fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (fd < 0) {
+		fprintf(stderr, "%s: signalfd failed: %m\n", __func__);
+		return -1;
+	}
+	register_fd(fd, signal_poll, POLLIN, sess);
+	return 0;
 }
 
-/* process_arguments - Process arguments
- * @argc: Number of arguments
- * @argv: Pointer to an array of pointers to arguments
+/* control_cmd() - Run one control socket command
+ * @sess: Pointer to host_session
+ * @cmd: NUL terminated command line
  *
- * Return 0 if success, non-zero on some error
+ * Returns 0 on success, -1 if the command failed or is unknown
  */
-static int process_arguments(int argc, char *argv[])
+static int control_cmd(struct host_session *sess, const char *cmd)
 {
-	int ch;
-	const char *cmd = argv[0];
+	unsigned int xoff;
+	unsigned int xon;
 
-	while ((ch = getopt(argc, argv, "dhp:r:s:")) != -1) {
-		switch (ch) {
-		case 'd':
-			++debug_flag;
-			break;
-		case 'h':
-			usage(cmd);
-			exit(0);
-		case 'p':
-			port = optarg;
-			break;
-		case 'r':
-			spi_speed = atoi(optarg);
-			break;
-		case 's':
-			spi_dev = optarg;
-			break;
-		case '?':
-		default:
-			return 2;
-		}
+	if (sscanf(cmd, "flow %u %u", &xoff, &xon) == 2)
+		return flow_set_marks(sess, xoff, xon);
+	if (!strncmp(cmd, "stats", 5)) {
+		dump_stats(sess);
+		return 0;
 	}
-
-	argc -= optind;
-	argv += optind;
-
-	if (argc == 1)
-		host = argv[0];
-	else if (argc > 1) {
-		fprintf(stderr, "Too many arguments\n");
-		return 4;
+	if (!strncmp(cmd, "upgrade", 7)) {
+		sess->upgrade = true;	/* After the reply is sent */
+		return 0;
 	}
-
-	return 0;
+	return -1;
 }
 
-static void host_poll(void *data, struct pollfd *pfd)
+/* control_poll() - Handle datagrams on the control socket
+ * @data: Pointer to host_session
+ * @pfd: Poll state for the control socket
+ *
+ * Each datagram is one command. A reply of "ok" or "error" is sent if
+ * the sender has an address to reply to.
+ */
+static void control_poll(void *data, struct pollfd *pfd)
 {
 	struct host_session *sess = data;
-	unsigned short revents = pfd->revents;
-	uint8_t	inbuf[3];
-	unsigned int i;
-
-	if (revents & POLLERR) {
-		fprintf(stderr, "Error set\n");
+	struct sockaddr_un from;
+	socklen_t fromlen = sizeof(from);
+	char cmd[128];
+	const char *reply;
+	ssize_t len;
+
+	len = recvfrom(pfd->fd, cmd, sizeof(cmd) - 1, 0,
+		       (struct sockaddr *)&from, &fromlen);
+	if (len < 0)
 		return;
-	}
-	if (revents & POLLIN) {
-		ssize_t len;
-
-		if (sess->host_state == out_of_sync) {
-			len = recv(sess->fd, &inbuf[0], 1, MSG_NOSIGNAL);
-			if (len != 1)
-				return;
-			if (inbuf[0] & 0200) {
-				fprintf(stderr, "0200 set - oos\n");
-				return;
-			}
-			for (i = 1; i < sizeof(inbuf); ++i) {
-				len = recv(sess->fd, &inbuf[i], 1,
-					   MSG_NOSIGNAL);
-				if (len != 1) {
-					fprintf(stderr, "len wrong %zd\n", len);
-					return;
-				}
-			}
-			len = sizeof(inbuf);
-			sess->host_state = in_sync;
-		} else {
-			len = recv(sess->fd, inbuf, sizeof(inbuf),
-				   MSG_NOSIGNAL);
-			if (len < 0)
-				return;
-			if (len != sizeof(inbuf)) {
-				fprintf(stderr, "len wrong %zd\n", len);
-				sess->host_state = out_of_sync;
-				return;
-			}
-		}
-		if (len != sizeof(inbuf)) {
-			if (len < 0) {
-				int err = errno;
-
-				fprintf(stderr, "Error on recv, err=%d\n", err);
-				errno = err;
-				return;
-			}
-			if (len == 0) {
-				fprintf(stderr, "No data\n");
-				return;
-			}
-			fprintf(stderr, "Wrong size=%zd\n", len);
-			return;
-		}
+	cmd[len] = '\0';
+	reply = control_cmd(sess, cmd) < 0 ? "error\n" : "ok\n";
+	if (fromlen > sizeof(sa_family_t))
+		sendto(pfd->fd, reply, strlen(reply), MSG_DONTWAIT,
+		       (struct sockaddr *)&from, fromlen);
+}
 
-		int32_t	w = host_word(sess, inbuf);
-		uint32_t count;
+/* open_control() - Open the control socket
+ * @sess: Pointer to host_session
+ * @path: Path to bind the datagram socket to, "" for none
+ *
+ * Failure is reported but not fatal, plato_if runs without runtime
+ * control.
+ */
+static void open_control(struct host_session *sess, const char *path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	int fd;
 
-		if (w < 0) {
-			fprintf(stderr, "w = %04x\n", w);
-			return;
-		}
+	if (!*path)
+		return;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Control socket path too long\n");
+		return;
+	}
+	strcpy(addr.sun_path, path);
 
-#if HOST_DECODE1
-		decode_host_word(w);
-#endif /* HOST_DECODE1 */
-		put_host_word(sess, w);
-		count = host_word_count(sess);
-		if (count == XOFF1LIMIT || count == XOFF2LIMIT) {
-			fprintf(stderr, "count=%d ", count);
-			send_key(sess, KEY_XOFF);
-		}
-	} else {
-		fprintf(stderr, "revents=%04x\n", revents);
+	fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		fprintf(stderr, "%s: socket failed: %m\n", __func__);
+		return;
+	}
+	unlink(path);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		fprintf(stderr, "Failed to bind control socket %s: %m\n",
+			path);
+		close(fd);
+		return;
 	}
+	register_fd(fd, control_poll, POLLIN, sess);
 }
 
 /* open_spi() - Open spi device
@@ -1489,6 +5578,33 @@ err_exit:
 	return -1;
 }
 
+/* spi_open() - Open the SPI device to the terminal
+ * @sess: Pointer to host_session
+ *
+ * Words already queued may have waited out an outage, so they are left
+ * out of the delay histograms.
+ *
+ * Returns 0 on success, -1 on error
+ */
+static int spi_open(struct host_session *sess)
+{
+	sess->spi_fd = open_spi(spi_dev, spi_speed);
+	if (sess->spi_fd < 0)
+		return -1;
+	sess->delay_skip = host_word_count(sess);
+	return 0;
+}
+
+/* spi_close() - Close the SPI device, words are held until it reopens
+ * @sess: Pointer to host_session
+ */
+static void spi_close(struct host_session *sess)
+{
+	if (sess->spi_fd >= 0)
+		close(sess->spi_fd);
+	sess->spi_fd = -1;
+}
+
 /* main() - Main program
  * @argc: Count of arguments passed
  * @argv: Pointer to an array of pointers to arguments
@@ -1497,6 +5613,7 @@ err_exit:
  */
 int main(int argc, char *argv[])
 {
+	bool resumed;
 	int rc;
 	int i;
 
@@ -1505,45 +5622,50 @@ int main(int argc, char *argv[])
 		usage(argv[0]);
 		return rc;
 	}
+	self_argv = argv;
 
+	ring_init(&sess.inwd, sess.inwds, ARRAY_SIZE(sess.inwds));
 	for (i = 0; i < VOICES; ++i)
-		sess.voices[i].wave = sq;
+		setwave(&sess.gsw, i, &sq);
 
 #if NO_TERMINAL
 	sess.next_time = keys[0].delay;
 #endif /* NO_TERMINAL */
 
-	sess.spi_fd = open_spi(spi_dev, spi_speed);
-	if (sess.spi_fd < 0) {
-		int err = errno;
-
-		fprintf(stderr, "Failed to open SPI device %s, errno=%d\n",
-			spi_dev, err);
-		exit(err);
-	}
-	fcntl(sess.spi_fd, F_SETFL, O_NONBLOCK);
-
-	sess.fd = open_host(host);
-	if (sess.fd < 0) {
-		int err = errno;
-
-		fprintf(stderr, "Failed to open host %s, errno=%d\n",
-			host, err);
-		exit(err);
+	if (open_poll() < 0 || open_signals(&sess) < 0)
+		return 1;
+	open_control(&sess, ctl_path);
+	open_stats(&sess, stats_path);
+	open_obs(obs_name);
+	resumed = upgrade_resume(&sess);
+
+	if (!resumed) {
+		gpio_setup();
+		status_show(&sess, "Starting up");
 	}
-
-	if (open_gsw(&sess) < 0) {
-		fprintf(stderr, "open_gsw failed\n");
+	subsys_init(&sess.spi, "SPI", spi_open, spi_close, &sess);
+	if (sess.spi_fd >= 0)
+		sess.spi.up = true;	/* Inherited from the old binary */
+	else
+		subsys_start(&sess.spi);
+
+	sess.word_timer_fd = open_timer(word_timer_poll, &sess);
+	if (open_clock(&sess) < 0) {
+		fprintf(stderr, "No word clock\n");
 		return 1;
 	}
 
-	struct pollfd pfd = {
-		.fd = sess.fd, .events = POLLERR | POLLIN, .revents = POLLIN
-	};
+	sess.host_timer_fd = open_timer(host_timer_poll, &sess);
+	open_netlink(&sess);
+	if (sess.conn != HOST_UP)
+		host_connect(&sess);
 
 	for (;;) {
-		do_poll(0);
-		host_poll(&sess, &pfd);
+		if (do_poll(-1) < 0)
+			return 1;
+		host_flush(&sess);
+		if (sess.upgrade)
+			upgrade_exec(&sess);
 	}
 
 	return 0;
@@ -0,0 +1,139 @@
+/*
+ * plato_text - Pack ASCII text into PLATO terminal words
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program in the file named COPYING.
+ *
+ * Copyright © 2014 Mark Rustad <MRustad@mac.com>
+ *
+ * Shared by plato_if and platomsg, so that both draw text the same way.
+ */
+
+#ifndef PLATO_TEXT_H
+#define PLATO_TEXT_H
+
+#include <stdint.h>
+
+/* ASCII to PLATO character code, with the character memory in bits 6-7 */
+static const uint8_t a2p[256] = {
+	[':'] = 0,	['a'] = 1,	['b'] = 2,	['c'] = 3,
+	['d'] = 4,	['e'] = 5,	['f'] = 6,	['g'] = 7,
+	['h'] = 8,	['i'] = 9,	['j'] = 10,	['k'] = 11,
+	['l'] = 12,	['m'] = 13,	['n'] = 14,	['o'] = 15,
+	['p'] = 16,	['q'] = 17,	['r'] = 18,	['s'] = 19,
+	['t'] = 20,	['u'] = 21,	['v'] = 22,	['w'] = 23,
+	['x'] = 24,	['y'] = 25,	['z'] = 26,	['0'] = 27,
+	['1'] = 28,	['2'] = 29,	['3'] = 30,	['4'] = 31,
+	['5'] = 32,	['6'] = 33,	['7'] = 34,	['8'] = 35,
+	['9'] = 36,	['+'] = 37,	['-'] = 38,	['*'] = 39,
+	['/'] = 40,	['('] = 41,	[')'] = 42,	['$'] = 43,
+	['='] = 44,	[' '] = 45,	[','] = 46,	['.'] = 47,
+			['%'] = 49,	['['] = 50,	[']'] = 51,
+					['\''] = 54,	['"'] = 55,
+	['!'] = 56,	[';'] = 57,	['<'] = 58,	['>'] = 59,
+	['_'] = 60,	['?'] = 61,
+	['#'] = 64,	['A'] = 65,	['B'] = 66,	['C'] = 67,
+	['D'] = 68,	['E'] = 69,	['F'] = 70,	['G'] = 71,
+	['H'] = 72,	['I'] = 73,	['J'] = 74,	['K'] = 75,
+	['L'] = 76,	['M'] = 77,	['N'] = 78,	['O'] = 79,
+	['P'] = 80,	['Q'] = 81,	['R'] = 82,	['S'] = 83,
+	['T'] = 84,	['U'] = 85,	['V'] = 86,	['W'] = 87,
+	['X'] = 88,	['Y'] = 89,	['Z'] = 90,
+			['^'] = 93,
+	['~'] = 100,
+			['{'] = 105,	['}'] = 106,	['&'] = 107,
+					['|'] = 110,
+			['@'] = 125,	['\\'] = 126,
+};
+
+/* struct plato_text - Character codes being packed into terminal words
+ * @put: Called with each terminal word completed
+ * @ctx: Passed to @put
+ * @bits: Character bits not yet in a word
+ * @bit_count: Number of bits in @bits
+ * @mem: Character memory selected, -1 for none yet
+ */
+struct plato_text {
+	void		(*put)(void *ctx, uint32_t word);
+	void		*ctx;
+	uint32_t	bits;
+	unsigned int	bit_count;
+	int8_t		mem;
+};
+
+/* host_word_parity - Compute host word parity
+ * @w: 19-bit word to compute parity on
+ *
+ * Return 1 if parity was odd, 0 if it was even
+ */
+static inline uint32_t host_word_parity(uint32_t w)
+{
+	static const uint32_t	p32 = 0x96696996;
+	uint32_t	parity = 0;
+
+	while (w) {
+		uint8_t	bits = w & 037;		/* Extract 5 bits */
+
+		parity ^= (p32 >> bits) & 1;
+		w >>= 5;
+	}
+
+	return parity;
+}
+
+/* make_word() - Make a terminal word by adding start bit and parity
+ * @word: Word without start bit or parity
+ */
+static inline uint32_t make_word(uint32_t word)
+{
+	word |= host_word_parity(word);
+	word |= 1 << 20;
+	return word;
+}
+
+/* text_tb() - Add a six bit character code
+ * @t: Pointer to plato_text
+ * @tb: Character code
+ *
+ * Three codes make a data word, which is passed to @t->put.
+ */
+static inline void text_tb(struct plato_text *t, uint8_t tb)
+{
+	t->bits = (t->bits << 6) | (tb & 077);
+	t->bit_count += 6;
+	if (t->bit_count < 18)
+		return;
+	t->put(t->ctx, make_word((1 << 19) | (t->bits << 1)));
+	t->bits = 0;
+	t->bit_count = 0;
+}
+
+/* text_ascii() - Add ASCII text, selecting character memories as needed
+ * @t: Pointer to plato_text
+ * @abp: NUL terminated text
+ */
+static inline void text_ascii(struct plato_text *t, const uint8_t *abp)
+{
+	for (; *abp; ++abp) {
+		uint8_t pb = a2p[*abp];
+		uint8_t mem = (pb >> 6) & 3;
+
+		if (mem != t->mem) {
+			text_tb(t, 077);
+			text_tb(t, 020 + mem);
+			t->mem = mem;
+		}
+		text_tb(t, pb & 077);
+	}
+}
+
+#endif /* PLATO_TEXT_H */
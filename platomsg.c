@@ -31,6 +31,8 @@
 #include <sys/types.h>
 #include <linux/spi/spidev.h>
 
+#include "plato_text.h"
+
 #define HOST_DECODE 0
 
 #define ARRAY_SIZE(x)	(sizeof(x) / sizeof((x)[0]))
@@ -54,12 +56,10 @@ static const uint32_t cmd_clear_screen =
 
 struct host_session {
 	int		spi_fd;		/* SPI file descriptor */
-	uint32_t	word_bits;	/* Accumulated data word bits */
+	struct plato_text text;		/* Text being packed into words */
 	uint32_t	key_bits;	/* Accumulated keyset bits */
 	uint16_t	key_bit_count;	/* Count of bits accumulated */
 	bool		key_stop_search;
-	int8_t		current_mem;	/* Current character memory */
-	uint8_t		word_bit_count;	/* Count of bits in word_bits */
 	uint8_t		spi_buf[6];
 };
 
@@ -75,37 +75,10 @@ static int clear_screen;
 static const char *spi_dev = "/dev/spidev1.0";
 static uint32_t	spi_speed = 5040;
 
-static struct host_session sess = { .current_mem = -1 };
-
-static const uint8_t a2p[256] = {
-	[':'] = 0,	['a'] = 1,	['b'] = 2,	['c'] = 3,
-	['d'] = 4,	['e'] = 5,	['f'] = 6,	['g'] = 7,
-	['h'] = 8,	['i'] = 9,	['j'] = 10,	['k'] = 11,
-	['l'] = 12,	['m'] = 13,	['n'] = 14,	['o'] = 15,
-	['p'] = 16,	['q'] = 17,	['r'] = 18,	['s'] = 19,
-	['t'] = 20,	['u'] = 21,	['v'] = 22,	['w'] = 23,
-	['x'] = 24,	['y'] = 25,	['z'] = 26,	['0'] = 27,
-	['1'] = 28,	['2'] = 29,	['3'] = 30,	['4'] = 31,
-	['5'] = 32,	['6'] = 33,	['7'] = 34,	['8'] = 35,
-	['9'] = 36,	['+'] = 37,	['-'] = 38,	['*'] = 39,
-	['/'] = 40,	['('] = 41,	[')'] = 42,	['$'] = 43,
-	['='] = 44,	[' '] = 45,	[','] = 46,	['.'] = 47,
-			['%'] = 49,	['['] = 50,	[']'] = 51,
-					['\''] = 54,	['"'] = 55,
-	['!'] = 56,	[';'] = 57,	['<'] = 58,	['>'] = 59,
-	['_'] = 60,	['?'] = 61,
-	['#'] = 64,	['A'] = 65,	['B'] = 66,	['C'] = 67,
-	['D'] = 68,	['E'] = 69,	['F'] = 70,	['G'] = 71,
-	['H'] = 72,	['I'] = 73,	['J'] = 74,	['K'] = 75,
-	['L'] = 76,	['M'] = 77,	['N'] = 78,	['O'] = 79,
-	['P'] = 80,	['Q'] = 81,	['R'] = 82,	['S'] = 83,
-	['T'] = 84,	['U'] = 85,	['V'] = 86,	['W'] = 87,
-	['X'] = 88,	['Y'] = 89,	['Z'] = 90,
-			['^'] = 93,
-	['~'] = 100,
-			['{'] = 105,	['}'] = 106,	['&'] = 107,
-					['|'] = 110,
-			['@'] = 125,	['\\'] = 126,
+static void text_put(void *ctx, uint32_t word);
+
+static struct host_session sess = {
+	.text = { .put = text_put, .ctx = &sess, .mem = -1 },
 };
 
 #define KEY_NEXT	026
@@ -334,55 +307,14 @@ static void process_spi_input(struct host_session *sess)
 }
 #endif /* 0 */
 
-/* host_word_parity - Compute host word parity
- * @w: 19-bit word to compute parity on
- *
- * Return 1 if parity was odd, 0 if it was even
- */
-static uint32_t	host_word_parity(uint32_t w)
-{
-	static const uint32_t	p32 = 0x96696996;
-	uint32_t	parity = 0;
-
-	while (w) {
-		uint8_t	bits = w & 037;		/* Extract 5 bits */
-
-		parity ^= (p32 >> bits) & 1;
-		w >>= 5;
-	}
-
-	return parity;
-}
-
 /**
- * make_word - Make host word by adding start bit and parity
- * @word: Host data
- *
- * Returns host word
- */
-static uint32_t make_word(uint32_t word)
-{
-	word |= host_word_parity(word);
-	word |= 1 << 20;
-	return word;
-}
-
-/**
- * pack_tb - Pack text mode bytes
- * @sess: Pointer to host_session
- * @tb: Text byte (6-bit value)
+ * text_put - Send a word of packed text to terminal
+ * @ctx: Pointer to host_session
+ * @word: Word to send to terminal
  */
-static void pack_tb(struct host_session *sess, uint8_t tb)
+static void text_put(void *ctx, uint32_t word)
 {
-	sess->word_bits = (sess->word_bits << 6) | (tb & 077);
-	sess->word_bit_count += 6;
-	if (sess->word_bit_count < 18)
-		return;
-	sess->word_bits <<= 1;
-	sess->word_bits |= 1 << 19;
-	send_word(sess, make_word(sess->word_bits));
-	sess->word_bits = 0;
-	sess->word_bit_count = 0;
+	send_word(ctx, word);
 }
 
 /**
@@ -391,39 +323,19 @@ static void pack_tb(struct host_session *sess, uint8_t tb)
  */
 static void flush_data(struct host_session *sess)
 {
-	switch (sess->word_bit_count) {
+	switch (sess->text.bit_count) {
 	case 12:
-		pack_tb(sess, 077);
-		pack_tb(sess, 077);
+		text_tb(&sess->text, 077);
+		text_tb(&sess->text, 077);
 		/* Fall through */
 	case 6:
-		pack_tb(sess, 077);
-		pack_tb(sess, 020 + sess->current_mem);
+		text_tb(&sess->text, 077);
+		text_tb(&sess->text, 020 + sess->text.mem);
 	case 0:
 		return;
 	default:
-		fprintf(stderr, "Unexpected bit count = %d\n",
-			sess->word_bit_count);
-	}
-}
-
-/**
- * send_text - Convert and send ASCII text to terminal
- * @sess: Pointer to host_session
- * @abp: Pointer to bytes to send
- */
-static void send_text(struct host_session *sess, const uint8_t *abp)
-{
-	for (; *abp; ++abp) {
-		uint8_t pb = a2p[*abp];
-		uint8_t mem = (pb >> 6) & 3;
-
-		if (mem != sess->current_mem) {
-			pack_tb(sess, 077);
-			pack_tb(sess, 020 + mem);
-			sess->current_mem = mem;
-		}
-		pack_tb(sess, pb & 077);
+		fprintf(stderr, "Unexpected bit count = %u\n",
+			sess->text.bit_count);
 	}
 }
 
@@ -593,8 +505,8 @@ int main(int argc, char *argv[])
 
 	if (clear_screen) {
 		send_word(&sess, make_word(cmd_clear_screen));
-		pack_tb(&sess, 077);
-		pack_tb(&sess, 014);
+		text_tb(&sess.text, 077);
+		text_tb(&sess.text, 014);
 	}
 
 	if (argc <= 0)
@@ -603,12 +515,12 @@ int main(int argc, char *argv[])
 	for (; argc > 0; ++argv, --argc) {
 		uint8_t *a = (uint8_t *)argv[0];
 
-		send_text(&sess, a);
+		text_ascii(&sess.text, a);
 		if (argc > 1 && *argv[1])
-			send_text(&sess, (uint8_t *)" ");
+			text_ascii(&sess.text, (uint8_t *)" ");
 	}
-	pack_tb(&sess, 077);
-	pack_tb(&sess, 015);
+	text_tb(&sess.text, 077);
+	text_tb(&sess.text, 015);
 	flush_data(&sess);
 
 	return 0;